@@ -3,51 +3,84 @@
 
 #include <Arduino.h>
 #include <stdint.h>
+#include <util/delay_basic.h>
+
+#include "gpio.hpp"
 
 typedef unsigned char  byte_t;
 typedef unsigned short word_t;
 
-#define BIN0(val) (((val)&0x01ll) ? 1 : 0)
-#define BIN1(val) (((val)&0x02ll) ? 1 : 0)
-#define BIN2(val) (((val)&0x04ll) ? 1 : 0)
-#define BIN3(val) (((val)&0x08ll) ? 1 : 0)
-#define BIN4(val) (((val)&0x10ll) ? 1 : 0)
-#define BIN5(val) (((val)&0x20ll) ? 1 : 0)
-#define BIN6(val) (((val)&0x40ll) ? 1 : 0)
-#define BIN7(val) (((val)&0x80ll) ? 1 : 0)
+// Cycle counted waits, in iterations of _delay_loop_2() which take 4 cycles each (250ns at 16MHz). Everything is
+// converted at compile time so no division ever runs on the controller.
+typedef uint16_t wait_t;
+
+constexpr wait_t ns(uint32_t value) { return (value * (F_CPU / 1000000) + 3999) / 4000; }
+constexpr wait_t us(uint32_t value) { return ns(value * 1000); }
+
+inline void wait(wait_t loops) {
+  if (loops) _delay_loop_2(loops);
+}
+
+// Worst case timings from the datasheets, the counter ones are the breadboard's own
+typedef struct profile_t {
+  wait_t  enable;       // CE# low to output valid (tCE)
+  wait_t  output;       // OE# low to output valid (tOE)
+  wait_t  release;      // OE# high to data bus released (tDF)
+  wait_t  address;      // Counter clock to output valid, counter propagation plus tACC
+  wait_t  clock;        // Counter clock pulse width
+  wait_t  write_pulse;  // WE# pulse width (tWP)
+  wait_t  data_hold;    // Data hold after WE# high (tDH)
+  wait_t  write_cycle;  // Internal write cycle (tWC)
+  uint8_t page_size;    // Bytes written in a single write cycle, 1 for chips without page mode
+} profile_t;
+
+// Indexed by the chip profile sent during the handshake
+constexpr profile_t chip_profiles[] = {
+    // Generic, slow enough for any 28C series part on long breadboard wires
+    {us(1), us(1), us(1), us(2), us(1), us(1), us(1), us(10000), 1},
+    // AT28C16
+    {ns(250), ns(100), ns(60), ns(500), ns(250), ns(100), ns(10), us(1000), 1},
+    // AT28C64B
+    {ns(150), ns(70), ns(50), ns(400), ns(250), ns(100), ns(10), us(10000), 64},
+    // AT28C256
+    {ns(150), ns(70), ns(50), ns(400), ns(250), ns(100), ns(10), us(10000), 64},
+};
 
-#define TIMEOUT 2
+constexpr uint8_t chip_profile_count = sizeof(chip_profiles) / sizeof(chip_profiles[0]);
 
+// Wiring must provide gpio<> types for the address counter (addr_clk, addr_next), the write enable, output enable
+// and chip enable lines of both chips (low_in, low_out, low_en, high_in, high_out, high_en) and a gpio_bus<> for the
+// shared data lines
+template <class Wiring>
 class EEPROM {
  public:
-  EEPROM(const uint8_t clk_pin,
-         const uint8_t next_pin,
-         const uint8_t lin_pin,
-         const uint8_t lout_pin,
-         const uint8_t len_pin,
-         const uint8_t hin_pin,
-         const uint8_t hout_pin,
-         const uint8_t hen_pin,
-         const uint8_t data0_pin,
-         const uint8_t data1_pin,
-         const uint8_t data2_pin,
-         const uint8_t data3_pin,
-         const uint8_t data4_pin,
-         const uint8_t data5_pin,
-         const uint8_t data6_pin,
-         const uint8_t data7_pin);
-
   void init();
   void next();
 
-  uint8_t addr = 0;
+  // The counter only counts up and has no reset line, so going back means wrapping around the whole address space.
+  // That is done in a single burst of clock pulses, with the outputs only settling once at the end.
+  void seek(uint16_t address);
+
+  // The counter cascade is as wide as the address bus of the chip, so both wrap around at the last address
+  uint16_t  addr    = 0;
+  uint16_t  mask    = 0xFF;
+  profile_t profile = chip_profiles[0];
 
   byte_t read_low();
   byte_t read_high();
 
+  // Only start the write cycle, or load the next byte of the page on page mode chips
   void write_low(byte_t data);
   void write_high(byte_t data);
 
+  // Wait for the write cycle to complete, false if it doesn't within twice the tWC of the profile
+  bool wait_low();
+  bool wait_high();
+
+  // Write a single byte and wait for the write cycle to complete, false if it doesn't read back in time
+  bool program_low(byte_t data);
+  bool program_high(byte_t data);
+
   void start_low();
   void start_high();
 
@@ -55,265 +88,227 @@ class EEPROM {
   void end_high();
 
  private:
-  uint8_t _addr_clk  = 0;
-  uint8_t _addr_next = 0;
-
-  uint8_t _low_in     = 0;
-  uint8_t _low_out    = 0;
-  uint8_t _low_enable = 0;
-
-  uint8_t _high_in     = 0;
-  uint8_t _high_out    = 0;
-  uint8_t _high_enable = 0;
-
-  uint8_t _data0 = 0;
-  uint8_t _data1 = 0;
-  uint8_t _data2 = 0;
-  uint8_t _data3 = 0;
-  uint8_t _data4 = 0;
-  uint8_t _data5 = 0;
-  uint8_t _data6 = 0;
-  uint8_t _data7 = 0;
+  typedef typename Wiring::addr_clk  _addr_clk;
+  typedef typename Wiring::addr_next _addr_next;
+
+  typedef typename Wiring::low_in  _low_in;
+  typedef typename Wiring::low_out _low_out;
+  typedef typename Wiring::low_en  _low_enable;
+
+  typedef typename Wiring::high_in  _high_in;
+  typedef typename Wiring::high_out _high_out;
+  typedef typename Wiring::high_en  _high_enable;
+
+  typedef typename Wiring::data _data;
+
+  template <class Out>
+  byte_t read();
+
+  template <class In>
+  void write(byte_t data);
+
+  template <class Out>
+  bool poll();
+
+  template <class In, class Out>
+  bool program(byte_t data);
 };
 
-EEPROM::EEPROM(const uint8_t clk_pin,
-               const uint8_t next_pin,
-               const uint8_t lin_pin,
-               const uint8_t lout_pin,
-               const uint8_t len_pin,
-               const uint8_t hin_pin,
-               const uint8_t hout_pin,
-               const uint8_t hen_pin,
-               const uint8_t data0_pin,
-               const uint8_t data1_pin,
-               const uint8_t data2_pin,
-               const uint8_t data3_pin,
-               const uint8_t data4_pin,
-               const uint8_t data5_pin,
-               const uint8_t data6_pin,
-               const uint8_t data7_pin)
-    :
-
-      _addr_clk(clk_pin),
-      _addr_next(next_pin),
-      _low_in(lin_pin),
-      _low_out(lout_pin),
-      _low_enable(len_pin),
-      _high_in(hin_pin),
-      _high_out(hout_pin),
-      _high_enable(hen_pin),
-      _data0(data0_pin),
-      _data1(data1_pin),
-      _data2(data2_pin),
-      _data3(data3_pin),
-      _data4(data4_pin),
-      _data5(data5_pin),
-      _data6(data6_pin),
-      _data7(data7_pin) {}
-
-void EEPROM::init() {
-  pinMode(_addr_clk, OUTPUT);
-  pinMode(_addr_next, OUTPUT);
-
-  pinMode(_low_in, OUTPUT);
-  pinMode(_low_out, OUTPUT);
-  pinMode(_low_enable, OUTPUT);
-
-  pinMode(_high_in, OUTPUT);
-  pinMode(_high_out, OUTPUT);
-  pinMode(_high_enable, OUTPUT);
-
-  pinMode(_data0, INPUT);
-  pinMode(_data1, INPUT);
-  pinMode(_data2, INPUT);
-  pinMode(_data3, INPUT);
-  pinMode(_data4, INPUT);
-  pinMode(_data5, INPUT);
-  pinMode(_data6, INPUT);
-  pinMode(_data7, INPUT);
-
-  digitalWrite(_addr_clk, LOW);
-  digitalWrite(_addr_next, LOW);
-
-  digitalWrite(_low_in, HIGH);
-  digitalWrite(_low_out, HIGH);
-  digitalWrite(_low_enable, HIGH);
-
-  digitalWrite(_high_in, HIGH);
-  digitalWrite(_high_out, HIGH);
-  digitalWrite(_high_enable, HIGH);
-
-  delay(TIMEOUT);
+template <class Wiring>
+void EEPROM<Wiring>::init() {
+  // The control lines are active low, so they have to be high before they start driving anything, otherwise WE#
+  // and CE# both go low for a moment and latch a stray write on every reset
+  _low_in::high();
+  _low_out::high();
+  _low_enable::high();
+
+  _high_in::high();
+  _high_out::high();
+  _high_enable::high();
+
+  _addr_clk::low();
+  _addr_next::low();
+
+  _addr_clk::output();
+  _addr_next::output();
+
+  _low_in::output();
+  _low_out::output();
+  _low_enable::output();
+
+  _high_in::output();
+  _high_out::output();
+  _high_enable::output();
+
+  _data::input();
+
+  wait(profile.address);
+}
+
+template <class Wiring>
+void EEPROM<Wiring>::start_low() {
+  _low_enable::low();
+  wait(profile.enable);
+}
+
+template <class Wiring>
+void EEPROM<Wiring>::end_low() {
+  _low_enable::high();
+  wait(profile.release);
+}
+
+template <class Wiring>
+void EEPROM<Wiring>::start_high() {
+  _high_enable::low();
+  wait(profile.enable);
 }
 
-void EEPROM::start_low() {
-  digitalWrite(_low_enable, LOW);
-  delay(TIMEOUT);
+template <class Wiring>
+void EEPROM<Wiring>::end_high() {
+  _high_enable::high();
+  wait(profile.release);
 }
 
-void EEPROM::end_low() {
-  digitalWrite(_low_enable, HIGH);
-  delay(TIMEOUT);
+template <class Wiring>
+void EEPROM<Wiring>::next() {
+  _addr_next::high();
+  _addr_clk::high();
+  wait(profile.clock);
+
+  _addr_clk::low();
+  _addr_next::low();
+  wait(profile.address);
+
+  addr = (addr + 1) & mask;
+}
+
+template <class Wiring>
+void EEPROM<Wiring>::seek(uint16_t address) {
+  uint16_t steps = (address - addr) & mask;
+
+  if (!steps) return;
+
+  _addr_next::high();
+
+  do {
+    _addr_clk::high();
+    wait(profile.clock);
+
+    _addr_clk::low();
+    wait(profile.clock);
+
+    // A wrap around a large chip takes long enough to overrun the UART
+    if ((steps & 0x3F) == 0) yield();
+  } while (--steps);
+
+  _addr_next::low();
+  wait(profile.address);
+
+  addr = address;
+}
+
+template <class Wiring>
+byte_t EEPROM<Wiring>::read_low() {
+  return read<_low_out>();
+}
+
+template <class Wiring>
+byte_t EEPROM<Wiring>::read_high() {
+  return read<_high_out>();
 }
 
-void EEPROM::start_high() {
-  digitalWrite(_high_enable, LOW);
-  delay(TIMEOUT);
+template <class Wiring>
+void EEPROM<Wiring>::write_low(byte_t data) {
+  write<_low_in>(data);
 }
 
-void EEPROM::end_high() {
-  digitalWrite(_high_enable, HIGH);
-  delay(TIMEOUT);
+template <class Wiring>
+void EEPROM<Wiring>::write_high(byte_t data) {
+  write<_high_in>(data);
 }
 
-void EEPROM::next() {
-  digitalWrite(_addr_next, HIGH);
-  digitalWrite(_addr_clk, HIGH);
-  delay(TIMEOUT);
+template <class Wiring>
+bool EEPROM<Wiring>::wait_low() {
+  return poll<_low_out>();
+}
 
-  digitalWrite(_addr_clk, LOW);
-  digitalWrite(_addr_next, LOW);
-  delay(TIMEOUT);
+template <class Wiring>
+bool EEPROM<Wiring>::wait_high() {
+  return poll<_high_out>();
+}
 
-  addr++;
+template <class Wiring>
+bool EEPROM<Wiring>::program_low(byte_t data) {
+  return program<_low_in, _low_out>(data);
 }
 
-byte_t EEPROM::read_low() {
-  byte low = 0;
-
-  pinMode(_data0, INPUT);
-  pinMode(_data1, INPUT);
-  pinMode(_data2, INPUT);
-  pinMode(_data3, INPUT);
-  pinMode(_data4, INPUT);
-  pinMode(_data5, INPUT);
-  pinMode(_data6, INPUT);
-  pinMode(_data7, INPUT);
-  delay(TIMEOUT);
-
-  digitalWrite(_low_out, LOW);
-  delay(TIMEOUT);
-
-  low |= digitalRead(_data0) << 0;
-  low |= digitalRead(_data1) << 1;
-  low |= digitalRead(_data2) << 2;
-  low |= digitalRead(_data3) << 3;
-  low |= digitalRead(_data4) << 4;
-  low |= digitalRead(_data5) << 5;
-  low |= digitalRead(_data6) << 6;
-  low |= digitalRead(_data7) << 7;
-
-  digitalWrite(_low_out, HIGH);
-  delay(TIMEOUT);
-
-  return low;
+template <class Wiring>
+bool EEPROM<Wiring>::program_high(byte_t data) {
+  return program<_high_in, _high_out>(data);
 }
 
-byte_t EEPROM::read_high() {
-  byte high = 0;
-
-  pinMode(_data0, INPUT);
-  pinMode(_data1, INPUT);
-  pinMode(_data2, INPUT);
-  pinMode(_data3, INPUT);
-  pinMode(_data4, INPUT);
-  pinMode(_data5, INPUT);
-  pinMode(_data6, INPUT);
-  pinMode(_data7, INPUT);
-  delay(TIMEOUT);
-
-  digitalWrite(_high_out, LOW);
-  delay(TIMEOUT);
-
-  high |= digitalRead(_data0) << 0;
-  high |= digitalRead(_data1) << 1;
-  high |= digitalRead(_data2) << 2;
-  high |= digitalRead(_data3) << 3;
-  high |= digitalRead(_data4) << 4;
-  high |= digitalRead(_data5) << 5;
-  high |= digitalRead(_data6) << 6;
-  high |= digitalRead(_data7) << 7;
-
-  digitalWrite(_high_out, HIGH);
-  delay(TIMEOUT);
-
-  return high;
+template <class Wiring>
+template <class Out>
+byte_t EEPROM<Wiring>::read() {
+  _data::input();
+
+  Out::low();
+  wait(profile.output);
+
+  byte_t data = _data::read();
+
+  Out::high();
+  wait(profile.release);
+
+  return data;
 }
 
-void EEPROM::write_low(byte_t data) {
-  pinMode(_data0, OUTPUT);
-  pinMode(_data1, OUTPUT);
-  pinMode(_data2, OUTPUT);
-  pinMode(_data3, OUTPUT);
-  pinMode(_data4, OUTPUT);
-  pinMode(_data5, OUTPUT);
-  pinMode(_data6, OUTPUT);
-  pinMode(_data7, OUTPUT);
-  delay(TIMEOUT);
-
-  digitalWrite(_low_in, LOW);
-  delay(TIMEOUT);
-
-  digitalWrite(_data0, BIN0(data) ? HIGH : LOW);
-  digitalWrite(_data1, BIN1(data) ? HIGH : LOW);
-  digitalWrite(_data2, BIN2(data) ? HIGH : LOW);
-  digitalWrite(_data3, BIN3(data) ? HIGH : LOW);
-  digitalWrite(_data4, BIN4(data) ? HIGH : LOW);
-  digitalWrite(_data5, BIN5(data) ? HIGH : LOW);
-  digitalWrite(_data6, BIN6(data) ? HIGH : LOW);
-  digitalWrite(_data7, BIN7(data) ? HIGH : LOW);
-  delay(TIMEOUT);
-
-  digitalWrite(_low_in, HIGH);
-  delay(TIMEOUT);
-
-  pinMode(_data0, INPUT);
-  pinMode(_data1, INPUT);
-  pinMode(_data2, INPUT);
-  pinMode(_data3, INPUT);
-  pinMode(_data4, INPUT);
-  pinMode(_data5, INPUT);
-  pinMode(_data6, INPUT);
-  pinMode(_data7, INPUT);
-  delay(TIMEOUT);
+template <class Wiring>
+template <class In>
+void EEPROM<Wiring>::write(byte_t data) {
+  // The address is latched on the falling edge of WE# and the data on the rising one
+  In::low();
+  _data::write(data);
+  _data::output();
+  wait(profile.write_pulse);
+
+  In::high();
+  wait(profile.data_hold);
+
+  _data::input();
 }
 
-void EEPROM::write_high(byte_t data) {
-  pinMode(_data0, OUTPUT);
-  pinMode(_data1, OUTPUT);
-  pinMode(_data2, OUTPUT);
-  pinMode(_data3, OUTPUT);
-  pinMode(_data4, OUTPUT);
-  pinMode(_data5, OUTPUT);
-  pinMode(_data6, OUTPUT);
-  pinMode(_data7, OUTPUT);
-  delay(TIMEOUT);
-
-  digitalWrite(_high_in, LOW);
-  delay(TIMEOUT);
-
-  digitalWrite(_data0, BIN0(data) ? HIGH : LOW);
-  digitalWrite(_data1, BIN1(data) ? HIGH : LOW);
-  digitalWrite(_data2, BIN2(data) ? HIGH : LOW);
-  digitalWrite(_data3, BIN3(data) ? HIGH : LOW);
-  digitalWrite(_data4, BIN4(data) ? HIGH : LOW);
-  digitalWrite(_data5, BIN5(data) ? HIGH : LOW);
-  digitalWrite(_data6, BIN6(data) ? HIGH : LOW);
-  digitalWrite(_data7, BIN7(data) ? HIGH : LOW);
-  delay(TIMEOUT);
-
-  digitalWrite(_high_in, HIGH);
-  delay(TIMEOUT);
-
-  pinMode(_data0, INPUT);
-  pinMode(_data1, INPUT);
-  pinMode(_data2, INPUT);
-  pinMode(_data3, INPUT);
-  pinMode(_data4, INPUT);
-  pinMode(_data5, INPUT);
-  pinMode(_data6, INPUT);
-  pinMode(_data7, INPUT);
-  delay(TIMEOUT);
+template <class Wiring>
+template <class Out>
+bool EEPROM<Wiring>::poll() {
+  // Toggle bit polling: bit 6 flips on every read while the write cycle runs, so two equal reads in a row mean it's
+  // done. Gives up after twice the datasheet tWC, which in _delay_loop_2() iterations of 250ns is tWC / 2
+  // microseconds. The UART is drained in between, so the host can keep streaming while the chip is busy.
+  unsigned long start   = micros();
+  unsigned long limit   = profile.write_cycle >> 1;
+  byte_t        current = read<Out>();
+  byte_t        last;
+
+  do {
+    last    = current;
+    current = read<Out>();
+
+    if (current == last) return true;
+
+    yield();
+  } while (micros() - start < limit);
+
+  return false;
+}
+
+template <class Wiring>
+template <class In, class Out>
+bool EEPROM<Wiring>::program(byte_t data) {
+  write<In>(data);
+
+  // The data lines span several ports, so the last poll can straddle the end of the write cycle and only the read
+  // after it is guaranteed to hold the stored byte
+  return poll<Out>() && read<Out>() == data;
 }
 
 #endif
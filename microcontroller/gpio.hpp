@@ -0,0 +1,137 @@
+#ifndef _GPIO_H_
+#define _GPIO_H_
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Compile time mapping of the Arduino Nano pin numbers to the ATmega328 I/O registers. Every access compiles down to
+// a single sbi/cbi or in/out instruction on a constant register, instead of the table lookups digitalWrite() and
+// pinMode() do at runtime.
+
+#define GPIO_PORT_B 0
+#define GPIO_PORT_C 1
+#define GPIO_PORT_D 2
+
+constexpr uint8_t gpio_port(uint8_t pin) { return pin < 8 ? GPIO_PORT_D : (pin < 14 ? GPIO_PORT_B : GPIO_PORT_C); }
+constexpr uint8_t gpio_bit(uint8_t pin) { return pin < 8 ? pin : (pin < 14 ? pin - 8 : pin - 14); }
+constexpr uint8_t gpio_mask(uint8_t pin) { return 1 << gpio_bit(pin); }
+
+template <uint8_t port>
+struct gpio_registers {
+  static inline decltype(auto) out() {
+    if constexpr (port == GPIO_PORT_B) return (PORTB);
+    if constexpr (port == GPIO_PORT_C) return (PORTC);
+    if constexpr (port == GPIO_PORT_D) return (PORTD);
+  }
+
+  static inline decltype(auto) dir() {
+    if constexpr (port == GPIO_PORT_B) return (DDRB);
+    if constexpr (port == GPIO_PORT_C) return (DDRC);
+    if constexpr (port == GPIO_PORT_D) return (DDRD);
+  }
+
+  static inline decltype(auto) in() {
+    if constexpr (port == GPIO_PORT_B) return (PINB);
+    if constexpr (port == GPIO_PORT_C) return (PINC);
+    if constexpr (port == GPIO_PORT_D) return (PIND);
+  }
+};
+
+template <uint8_t pin>
+struct gpio {
+  typedef gpio_registers<gpio_port(pin)> registers;
+
+  static constexpr uint8_t mask = gpio_mask(pin);
+
+  static inline void output() { registers::dir() |= mask; }
+  // Like pinMode(INPUT), which also turns the pull-up off
+  static inline void input() {
+    registers::dir() &= (uint8_t)~mask;
+    registers::out() &= (uint8_t)~mask;
+  }
+
+  static inline void high() { registers::out() |= mask; }
+  static inline void low() { registers::out() &= (uint8_t)~mask; }
+
+  static inline bool read() { return registers::in() & mask; }
+};
+
+// Eight pins forming a byte wide bus, in bit order. The pins may be spread over several ports in any order, each
+// port is still accessed with a single read-modify-write.
+template <uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3, uint8_t d4, uint8_t d5, uint8_t d6, uint8_t d7>
+struct gpio_bus {
+  static inline void output() {
+    update_dir<GPIO_PORT_B>(true);
+    update_dir<GPIO_PORT_C>(true);
+    update_dir<GPIO_PORT_D>(true);
+  }
+
+  static inline void input() {
+    update_dir<GPIO_PORT_B>(false);
+    update_dir<GPIO_PORT_C>(false);
+    update_dir<GPIO_PORT_D>(false);
+  }
+
+  static inline void write(uint8_t value) {
+    update_out<GPIO_PORT_B>(value);
+    update_out<GPIO_PORT_C>(value);
+    update_out<GPIO_PORT_D>(value);
+  }
+
+  static inline uint8_t read() {
+    uint8_t b = port_mask(GPIO_PORT_B) ? (uint8_t)gpio_registers<GPIO_PORT_B>::in() : 0;
+    uint8_t c = port_mask(GPIO_PORT_C) ? (uint8_t)gpio_registers<GPIO_PORT_C>::in() : 0;
+    uint8_t d = port_mask(GPIO_PORT_D) ? (uint8_t)gpio_registers<GPIO_PORT_D>::in() : 0;
+
+    return gather<d0, 0>(b, c, d) | gather<d1, 1>(b, c, d) | gather<d2, 2>(b, c, d) | gather<d3, 3>(b, c, d) |
+           gather<d4, 4>(b, c, d) | gather<d5, 5>(b, c, d) | gather<d6, 6>(b, c, d) | gather<d7, 7>(b, c, d);
+  }
+
+ private:
+  static constexpr uint8_t port_mask(uint8_t port) {
+    return (gpio_port(d0) == port ? gpio_mask(d0) : 0) | (gpio_port(d1) == port ? gpio_mask(d1) : 0) |
+           (gpio_port(d2) == port ? gpio_mask(d2) : 0) | (gpio_port(d3) == port ? gpio_mask(d3) : 0) |
+           (gpio_port(d4) == port ? gpio_mask(d4) : 0) | (gpio_port(d5) == port ? gpio_mask(d5) : 0) |
+           (gpio_port(d6) == port ? gpio_mask(d6) : 0) | (gpio_port(d7) == port ? gpio_mask(d7) : 0);
+  }
+
+  template <uint8_t port, uint8_t pin, uint8_t bit>
+  static inline uint8_t scatter(uint8_t value) {
+    if constexpr (gpio_port(pin) != port) return 0;
+    return (value & (1 << bit)) ? gpio_mask(pin) : 0;
+  }
+
+  template <uint8_t pin, uint8_t bit>
+  static inline uint8_t gather(uint8_t b, uint8_t c, uint8_t d) {
+    uint8_t value = gpio_port(pin) == GPIO_PORT_B ? b : (gpio_port(pin) == GPIO_PORT_C ? c : d);
+    return (value & gpio_mask(pin)) ? (1 << bit) : 0;
+  }
+
+  template <uint8_t port>
+  static inline void update_dir(bool output) {
+    constexpr uint8_t mask = port_mask(port);
+    if constexpr (mask == 0) return;
+
+    if (output) {
+      gpio_registers<port>::dir() |= mask;
+    } else {
+      // The last byte written would otherwise keep the pull-ups of its one bits on, unlike pinMode(INPUT)
+      gpio_registers<port>::dir() &= (uint8_t)~mask;
+      gpio_registers<port>::out() &= (uint8_t)~mask;
+    }
+  }
+
+  template <uint8_t port>
+  static inline void update_out(uint8_t value) {
+    constexpr uint8_t mask = port_mask(port);
+    if constexpr (mask == 0) return;
+
+    uint8_t bits = scatter<port, d0, 0>(value) | scatter<port, d1, 1>(value) | scatter<port, d2, 2>(value) |
+                   scatter<port, d3, 3>(value) | scatter<port, d4, 4>(value) | scatter<port, d5, 5>(value) |
+                   scatter<port, d6, 6>(value) | scatter<port, d7, 7>(value);
+
+    gpio_registers<port>::out() = (uint8_t)((gpio_registers<port>::out() & (uint8_t)~mask) | bits);
+  }
+};
+
+#endif
@@ -1,151 +1,707 @@
 #include <Arduino.h>
+#include <util/crc16.h>
 
 #include "eeprom.hpp"
 
-constexpr uint8_t version = 0x02;
+constexpr uint8_t version = 0x10;
+
+// Rates the host can ask for, indexed by the 0x0c packet. 9600 is what every session starts at.
+constexpr uint32_t baud_rates[]    = {9600, 115200, 500000, 1000000};
+constexpr uint8_t  baud_rate_count = sizeof(baud_rates) / sizeof(baud_rates[0]);
+
+// Single byte rewrites of a byte that failed to verify, each one waits for its own write cycle
+constexpr uint8_t write_attempts = 3;
+
+// Words in a streamed chunk, which is also the largest page size so that a page never spans two chunks
+constexpr uint8_t chunk_words = 64;
+
+// Chunk buffers, the host gets one credit for each of them and may only send a chunk while it holds one
+constexpr uint8_t chunk_slots = 2;
+
+// Silence on the line after a corrupted chunk before asking for it again, long enough for anything the host had
+// already sent to arrive and be thrown away
+constexpr unsigned long resync_ms = 10;
+
+// One slot of the streaming buffer
+typedef struct chunk_t {
+  bool     ready = false;
+  bool     last  = false;
+  uint16_t start = 0x00;
+  uint8_t  size  = 0x00;
+
+  uint8_t high[chunk_words] = {};
+  uint8_t low[chunk_words]  = {};
+} chunk_t;
 
 typedef struct state_flags_t {
-  bool receiving_data  = false;
-  bool receiving_flags = false;
-  bool sending         = false;
-  bool high            = false;
-  bool low             = false;
-
-  uint8_t recv_size           = 0x00;
-  uint8_t recv_buff_pos       = 0x00;
-  uint8_t recv_buff_high[256] = {};
-  uint8_t recv_buff_low[256]  = {};
-
-  uint8_t send_size           = 0x00;
-  uint8_t send_buff_pos       = 0x00;
-  uint8_t send_buff_high[256] = {};
-  uint8_t send_buff_low[256]  = {};
+  bool receiving_chunk  = false;
+  bool receiving_index  = false;
+  bool receiving_header = false;
+  bool receiving_crc    = false;
+  bool receiving_flags  = false;
+  bool sending          = false;
+  bool writing          = false;
+  bool rereading        = false;
+  bool checksumming     = false;
+  bool restarting       = false;
+  bool high             = false;
+  bool low              = false;
+  bool smart            = false;
+
+  // Size and last flag of the chunk being received and its number, it only goes into its slot if it is the next one
+  // expected. Any other chunk is a stale one the host sent before a NAK, or one it already sent, and is dropped.
+  uint8_t chunk_header = 0x00;
+  uint8_t chunk_index  = 0x00;
+  bool    dropping     = false;
+
+  // Token of a compressed chunk being expanded: words left in it and whether they all repeat the same word
+  bool    compressed = false;
+  bool    repeat     = false;
+  uint8_t token_size = 0x00;
+
+  uint8_t baud_rate = 0x00;
+
+  uint8_t recv_size     = 0x00;
+  uint8_t recv_buff_pos = 0x00;
+
+  // CRC of the chunk being received, chunks taken so far, which is what a NAK asks the host to resend from, and the
+  // block the host asked to read again
+  uint16_t crc          = 0x0000;
+  uint8_t  chunk_count  = 0x00;
+  uint8_t  reread_block = 0x00;
+
+  // Chunk being filled by the UART and chunk being programmed, these only differ while more than one slot is taken
+  chunk_t chunks[chunk_slots] = {};
+  uint8_t chunk_fill          = 0x00;
+  uint8_t chunk_next          = 0x00;
+
+  uint32_t errors  = 0x00;
+  uint32_t skipped = 0x00;
+
+  // One bit per word of the chunk being programmed, set for the bytes that couldn't be written
+  uint8_t failed_high[chunk_words / 8] = {};
+  uint8_t failed_low[chunk_words / 8]  = {};
 } state_flags_t;
 
-EEPROM        eeprom(14, 13, 9, 10, 12, 2, 3, 11, 17, 16, 15, 8, 7, 6, 5, 4);
-state_flags_t state;
+// Breadboard wiring, also mirrored by the simulator in simulator/src/board.hpp
+typedef struct wiring_t {
+  typedef gpio<14> addr_clk;
+  typedef gpio<13> addr_next;
+
+  typedef gpio<9>  low_in;
+  typedef gpio<10> low_out;
+  typedef gpio<12> low_en;
+
+  typedef gpio<2>  high_in;
+  typedef gpio<3>  high_out;
+  typedef gpio<11> high_en;
+
+  typedef gpio_bus<17, 16, 15, 8, 7, 6, 5, 4> data;
+} wiring_t;
+
+EEPROM<wiring_t> eeprom;
+state_flags_t    state;
+
+void receive(uint8_t words);
 
 void setup() {
   eeprom.init();
 
-  Serial.begin(9600);
+  Serial.begin(baud_rates[0]);
   Serial.write(0x01);
   Serial.write(version);
 }
 
-void panic() {
-  cli();
+void negotiate_baud_rate(uint8_t requested) {
+  uint8_t previous = state.baud_rate;
+  uint8_t selected = requested < baud_rate_count ? requested : baud_rate_count - 1;
 
-  while (true) {
-    __asm__("nop\n\t");
+  Serial.write(0x0c);
+  Serial.write(selected);
+
+  if (selected == previous) return;
+
+  // Both sides switch once the reply is out, then the host proves the new rate works with a test pattern
+  Serial.flush();
+  Serial.begin(baud_rates[selected]);
+  Serial.setTimeout(250);
+
+  uint8_t pattern[2] = {0x00, 0x00};
+
+  if (Serial.readBytes(pattern, 2) == 2 && pattern[0] == 0x0d && pattern[1] == 0xa5) {
+    state.baud_rate = selected;
+
+    Serial.write(0x0d);
+    Serial.write(0x5a);
+
+  } else {
+    Serial.begin(baud_rates[previous]);
+
+    while (Serial.available()) {
+      Serial.read();
+    }
   }
+
+  Serial.setTimeout(1000);
 }
 
-void loop() {
-  if (state.sending) {
-    uint8_t i = 0x00;
+bool test_bit(const uint8_t* bitmap, uint8_t index) { return bitmap[index >> 3] & (1 << (index & 0x07)); }
 
-    do {
+void assign_bit(uint8_t* bitmap, uint8_t index, bool value) {
+  if (value) {
+    bitmap[index >> 3] |= 1 << (index & 0x07);
+  } else {
+    bitmap[index >> 3] &= ~(1 << (index & 0x07));
+  }
+}
+
+// Smart write: reading is far cheaper than a write cycle, so only the bytes that changed get one. The ones that
+// already match are as good as verified.
+void compare_word(const chunk_t& chunk, uint8_t i, bool& high_dirty, bool& low_dirty) {
+  high_dirty = !state.low;
+  low_dirty  = !state.high;
+
+  if (!state.smart) return;
+
+  if (high_dirty) {
+    eeprom.start_high();
+    high_dirty = eeprom.read_high() != chunk.high[i];
+    eeprom.end_high();
+
+    if (!high_dirty) state.skipped++;
+  }
+
+  if (low_dirty) {
+    eeprom.start_low();
+    low_dirty = eeprom.read_low() != chunk.low[i];
+    eeprom.end_low();
+
+    if (!low_dirty) state.skipped++;
+  }
+}
+
+// Verify the bytes written at the current address and reprogram the ones that didn't make it
+void verify_word(const chunk_t& chunk, uint8_t i, bool high_dirty, bool low_dirty) {
+  uint8_t attempts = 0x00;
+
+  if (high_dirty) {
+    eeprom.start_high();
+
+    bool written = eeprom.read_high() == chunk.high[i];
+
+    while (!written && attempts++ < write_attempts) {
+      written = eeprom.program_high(chunk.high[i]);
+    }
+
+    if (!written) {
+      assign_bit(state.failed_high, i, true);
+      state.errors++;
+    }
+
+    eeprom.end_high();
+  }
+
+  attempts = 0x00;
+
+  if (low_dirty) {
+    eeprom.start_low();
+
+    bool written = eeprom.read_low() == chunk.low[i];
+
+    while (!written && attempts++ < write_attempts) {
+      written = eeprom.program_low(chunk.low[i]);
+    }
+
+    if (!written) {
+      assign_bit(state.failed_low, i, true);
+      state.errors++;
+    }
+
+    eeprom.end_low();
+  }
+}
+
+// Without page mode every address can be compared, written and verified before moving on, so the counter only ever
+// moves forward and a chunk costs as many pulses as it has words. The write cycles of both chips still overlap.
+void write_bytes(const chunk_t& chunk) {
+  eeprom.seek(chunk.start);
+
+  for (uint8_t i = 0; i <= chunk.size; i++) {
+    bool high_dirty;
+    bool low_dirty;
+
+    compare_word(chunk, i, high_dirty, low_dirty);
+
+    if (high_dirty) {
+      eeprom.start_high();
+      eeprom.write_high(chunk.high[i]);
+      eeprom.end_high();
+    }
+
+    if (low_dirty) {
+      eeprom.start_low();
+      eeprom.write_low(chunk.low[i]);
+      eeprom.end_low();
+    }
+
+    if (high_dirty) {
+      eeprom.start_high();
+      eeprom.wait_high();
+      eeprom.end_high();
+    }
+
+    if (low_dirty) {
+      eeprom.start_low();
+      eeprom.wait_low();
+      eeprom.end_low();
+    }
+
+    verify_word(chunk, i, high_dirty, low_dirty);
+
+    eeprom.next();
+    yield();
+  }
+}
+
+// Page mode chips take the whole page before reading anything back, so the chunk takes separate passes and the
+// counter has to wrap around the chip to get back to its start. That only happens when something has to be written.
+void write_pages(const chunk_t& chunk) {
+  uint8_t page_last = eeprom.profile.page_size - 1;
+  bool    dirty     = false;
+
+  // One bit per word, set for the bytes that need a write cycle
+  uint8_t dirty_high[chunk_words / 8];
+  uint8_t dirty_low[chunk_words / 8];
+
+  // This has to be its own pass, reading in between the bytes of a page would end the page load early
+  eeprom.seek(chunk.start);
+
+  for (uint8_t i = 0; i <= chunk.size; i++) {
+    bool high_dirty;
+    bool low_dirty;
+
+    compare_word(chunk, i, high_dirty, low_dirty);
+
+    assign_bit(dirty_high, i, high_dirty);
+    assign_bit(dirty_low, i, low_dirty);
+    dirty = dirty || high_dirty || low_dirty;
+
+    if (state.smart) {
+      eeprom.next();
+      yield();
+    }
+  }
+
+  if (!dirty) return;
+
+  // Load both chips a byte at a time and only wait at the end of every page, so the write cycles of both chips
+  // and of every byte in a page overlap. Page mode chips start writing once no new byte arrives within 150us, and
+  // emptying a full receive buffer takes about that long, so only a few words are taken in between bytes. That is
+  // still faster than they arrive.
+  eeprom.seek(chunk.start);
+
+  for (uint8_t i = 0; i <= chunk.size; i++) {
+    if (test_bit(dirty_high, i)) {
+      eeprom.start_high();
+      eeprom.write_high(chunk.high[i]);
+      eeprom.end_high();
+    }
+
+    if (test_bit(dirty_low, i)) {
+      eeprom.start_low();
+      eeprom.write_low(chunk.low[i]);
+      eeprom.end_low();
+    }
+
+    if ((eeprom.addr & page_last) == page_last && i != chunk.size) {
       if (!state.low) {
         eeprom.start_high();
-        state.send_buff_high[i] = eeprom.read_high();
+        eeprom.wait_high();
         eeprom.end_high();
       }
 
       if (!state.high) {
         eeprom.start_low();
-        state.send_buff_low[i] = eeprom.read_low();
+        eeprom.wait_low();
         eeprom.end_low();
       }
 
+      yield();
+    }
+
+    eeprom.next();
+    receive(8);
+  }
+
+  // The last write cycle runs while the counter wraps around, toggle bit polling works at any address
+  eeprom.seek(chunk.start);
+
+  if (!state.low) {
+    eeprom.start_high();
+    eeprom.wait_high();
+    eeprom.end_high();
+  }
+
+  if (!state.high) {
+    eeprom.start_low();
+    eeprom.wait_low();
+    eeprom.end_low();
+  }
+
+  for (uint8_t i = 0; i <= chunk.size; i++) {
+    verify_word(chunk, i, test_bit(dirty_high, i), test_bit(dirty_low, i));
+
+    eeprom.next();
+    yield();
+  }
+}
+
+// Only chunks with bytes that couldn't be written get reported, as the start address and a bitmap of the words
+void report_failures(const chunk_t& chunk, uint8_t type, const uint8_t* bitmap) {
+  uint8_t any = 0x00;
+
+  for (uint8_t i = 0; i < chunk_words / 8; i++) {
+    any |= bitmap[i];
+  }
+
+  if (!any) return;
+
+  Serial.write(type);
+  Serial.write(chunk_words / 16);
+  Serial.write(chunk.start >> 8);
+  Serial.write(chunk.start & 0xFF);
+  Serial.write(bitmap, chunk_words / 8);
+}
+
+void write_chunk(const chunk_t& chunk) {
+  memset(state.failed_high, 0x00, sizeof(state.failed_high));
+  memset(state.failed_low, 0x00, sizeof(state.failed_low));
+
+  if (eeprom.profile.page_size > 1) {
+    write_pages(chunk);
+  } else {
+    write_bytes(chunk);
+  }
+}
+
+void panic() {
+  cli();
+
+  while (true) {
+    __asm__("nop\n\t");
+  }
+}
+
+// The Arduino core calls this while it waits, and so do the EEPROM wait loops. Draining the UART here is what lets
+// the next chunk arrive while the current one is being programmed.
+void yield() { receive(0xFF); }
+
+// Both chips at the current address, the one that isn't used reads as zero
+void read_word(uint8_t& data_high, uint8_t& data_low) {
+  data_high = 0x00;
+  data_low  = 0x00;
+
+  if (!state.low) {
+    eeprom.start_high();
+    data_high = eeprom.read_high();
+    eeprom.end_high();
+  }
+
+  if (!state.high) {
+    eeprom.start_low();
+    data_low = eeprom.read_low();
+    eeprom.end_low();
+  }
+}
+
+// Straight from the chips to the UART, which is slower than reading anyway, so nothing has to be buffered. Every block
+// of 256 words is followed by its CRC, so the host can ask for the ones that got corrupted again.
+void send_block() {
+  uint16_t crc = 0x0000;
+  uint8_t  i   = 0x00;
+
+  Serial.write(0x08);
+  Serial.write(0xFF);
+
+  do {
+    uint8_t data_high;
+    uint8_t data_low;
+
+    read_word(data_high, data_low);
+
+    Serial.write(data_high);
+    Serial.write(data_low);
+
+    crc = _crc_xmodem_update(crc, data_high);
+    crc = _crc_xmodem_update(crc, data_low);
+
+    eeprom.next();
+  } while (i++ < 0xFF);
+
+  Serial.write(crc >> 8);
+  Serial.write(crc & 0xFF);
+}
+
+// CRC-32 as used by zlib, there is no table for it in avr-libc and a table wouldn't fit anyway
+uint32_t crc32_update(uint32_t crc, uint8_t data) {
+  crc ^= data;
+
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = crc & 0x01 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+  }
+
+  return crc;
+}
+
+// Only the CRC-32 of every block of 256 words goes out, the host then reads back the blocks that don't match
+void send_checksums() {
+  Serial.write(0x16);
+  Serial.write(eeprom.mask >> 8);
+
+  do {
+    uint32_t crc = 0xFFFFFFFF;
+    uint8_t  i   = 0x00;
+
+    do {
+      uint8_t data_high;
+      uint8_t data_low;
+
+      read_word(data_high, data_low);
+
+      crc = crc32_update(crc, data_high);
+      crc = crc32_update(crc, data_low);
+
       eeprom.next();
     } while (i++ < 0xFF);
 
-    Serial.write(0x08);
-    Serial.write(0xFF);
+    crc = ~crc;
 
-    i = 0;
+    Serial.write(crc >> 24);
+    Serial.write((crc >> 16) & 0xFF);
+    Serial.write((crc >> 8) & 0xFF);
+    Serial.write(crc & 0xFF);
+  } while (eeprom.addr != 0x00);
+}
 
+void checksum(uint8_t data_high, uint8_t data_low) {
+  state.crc = _crc_xmodem_update(state.crc, data_high);
+  state.crc = _crc_xmodem_update(state.crc, data_low);
+}
+
+// Throw away the chunk being received and everything after it, then ask the host to send them again
+void resync() {
+  unsigned long quiet = millis();
+
+  while (millis() - quiet < resync_ms) {
+    if (Serial.available()) {
+      Serial.read();
+      quiet = millis();
+    }
+  }
+
+  state.receiving_index  = false;
+  state.receiving_header = false;
+  state.receiving_chunk  = false;
+  state.receiving_crc    = false;
+  state.dropping         = false;
+  state.recv_buff_pos    = 0;
+
+  Serial.write(0x13);
+  Serial.write(state.chunk_count);
+}
+
+// Back to where setup() leaves things, except for the baud rate, so the host can start another session without a reset
+void restart() {
+  uint8_t baud_rate = state.baud_rate;
+
+  eeprom.seek(0x00);
+
+  state           = state_flags_t {};
+  state.baud_rate = baud_rate;
+
+  Serial.write(0x01);
+  Serial.write(version);
+}
+
+void loop() {
+  // Whatever the last session left behind is dropped, including chunks that haven't been programmed yet
+  if (state.restarting) restart();
+
+  // The sending flag arrives before the rest of the flags, don't start until the handshake is done. When the session
+  // writes as well, the chips are only read back once the last chunk is done.
+  if (state.sending && !state.receiving_flags && !state.writing) {
+    // Large chips go out as several blocks, until the counter wraps back to the start
     do {
-      Serial.write(state.send_buff_high[i]);
-      Serial.write(state.send_buff_low[i]);
-    } while (i++ < 0xFF);
+      send_block();
+    } while (eeprom.addr != 0x00);
 
     state.sending = false;
   }
 
-  if (Serial.available() > 1) {
+  if (state.checksumming) {
+    state.checksumming = false;
+    send_checksums();
+  }
+
+  if (state.rereading) {
+    // Cleared first, the next request can already arrive while the counter is on its way back
+    state.rereading = false;
+
+    eeprom.seek((state.reread_block << 8) & eeprom.mask);
+    send_block();
+    eeprom.seek(0x00);
+  }
+
+  receive(0xFF);
+
+  chunk_t& chunk = state.chunks[state.chunk_next];
+
+  if (chunk.ready) {
+    write_chunk(chunk);
+
+    report_failures(chunk, 0x09, state.failed_high);
+    report_failures(chunk, 0x0a, state.failed_low);
+
+    // Only now the slot can take another chunk, so give the host its credit back, which also tells it the chunk is
+    // done
+    chunk.ready      = false;
+    state.chunk_next = (state.chunk_next + 1) % chunk_slots;
+
+    Serial.write(0x11);
+    Serial.write(0x01);
+
+    if (chunk.last) {
+      // The counter has no reset line, so the next session can only assume it starts at zero if this one leaves it
+      // there
+      eeprom.seek(0x00);
+
+      Serial.write(0x07);
+      Serial.write(0x03);
+
+      Serial.write(state.errors >> 24);
+      Serial.write((state.errors >> 16) & 0xFF);
+      Serial.write((state.errors >> 8) & 0xFF);
+      Serial.write(state.errors & 0xFF);
+      Serial.write(state.skipped >> 24);
+      Serial.write((state.skipped >> 16) & 0xFF);
+      Serial.write((state.skipped >> 8) & 0xFF);
+      Serial.write(state.skipped & 0xFF);
+
+      state.errors  = 0;
+      state.skipped = 0;
+      state.writing = false;
+    }
+  }
+}
+
+// Handles at most the given number of words, the receive buffer never holds more than 32 of them anyway
+void receive(uint8_t words) {
+  // The serial and delay functions can call yield() again, which must not interleave with the word being handled
+  static bool receiving = false;
+
+  if (receiving) return;
+  receiving = true;
+
+  while (words-- && Serial.available() > 1) {
     uint8_t data_high = 0x00;
     uint8_t data_low  = 0x00;
 
     Serial.readBytes(&data_high, 1);
     Serial.readBytes(&data_low, 1);
 
-    if (state.receiving_data) {
-      state.recv_buff_high[state.recv_buff_pos] = data_high;
-      state.recv_buff_low[state.recv_buff_pos]  = data_low;
+    if (state.receiving_index) {
+      // Number of the chunk modulo 256, only the next one the controller hasn't taken yet goes into a slot
+      chunk_t& chunk = state.chunks[state.chunk_fill];
 
-      if (state.recv_size == 0) {
-        state.recv_buff_pos  = 0;
-        state.receiving_data = false;
+      checksum(data_high, data_low);
 
-        uint8_t i        = 0x00;
-        uint8_t attempts = 0x00;
-        uint8_t errors   = 0x00;
+      state.receiving_index  = false;
+      state.receiving_header = true;
+      state.chunk_index      = data_high;
+      state.dropping         = data_high != state.chunk_count || chunk.ready;
 
-        do {
-          if (!state.low) {
-            eeprom.start_high();
+      if (!state.dropping) {
+        chunk.size = state.chunk_header & 0x7F;
+        chunk.last = state.chunk_header & 0x80;
+      }
 
-            do {
-              eeprom.write_high(state.recv_buff_high[i]);
+    } else if (state.receiving_header) {
+      // Start address of the chunk
+      chunk_t& chunk = state.chunks[state.chunk_fill];
+
+      if (!state.dropping) chunk.start = (data_high << 8) | data_low;
+      checksum(data_high, data_low);
+
+      state.receiving_header = false;
+      state.receiving_chunk  = true;
+      state.recv_buff_pos    = 0;
+      state.repeat           = false;
+      state.token_size       = 0;
+
+    } else if (state.receiving_chunk && state.compressed && state.token_size == 0) {
+      // Token of a compressed chunk, 0x00 for literal words or 0x01 for a run of the word that follows, and the
+      // number of words - 1
+      // A token longer than any chunk got corrupted, and a length of 0xFF would wrap the size around to zero
+      if (data_low >= chunk_words) {
+        resync();
+        continue;
+      }
 
-            } while ((attempts++ < 20) && (eeprom.read_high() != state.recv_buff_high[i]));
+      state.repeat     = data_high;
+      state.token_size = data_low + 1;
+      checksum(data_high, data_low);
 
-            if (eeprom.read_high() != state.recv_buff_high[i]) {
-              Serial.write(0x09);
-              Serial.write(i);
-              errors++;
+      // A token can only run past the end of its chunk if it got corrupted
+      if (state.recv_buff_pos + state.token_size > (state.chunk_header & 0x7F) + 1) resync();
 
-            } else {
-              Serial.write(0x0b);
-              Serial.write(i);
-            }
+    } else if (state.receiving_chunk) {
+      chunk_t& chunk = state.chunks[state.chunk_fill];
 
-            eeprom.end_high();
-          }
+      // Runs are expanded straight into the chunk, so programming never sees the difference. A dropped chunk is only
+      // parsed, its slot may still be busy.
+      uint8_t count = state.repeat ? state.token_size : 1;
+      checksum(data_high, data_low);
 
-          attempts = 0;
+      while (count--) {
+        if (!state.dropping) {
+          chunk.high[state.recv_buff_pos] = data_high;
+          chunk.low[state.recv_buff_pos]  = data_low;
+        }
 
-          if (!state.high) {
-            eeprom.start_low();
+        state.recv_buff_pos++;
+        if (state.compressed) state.token_size--;
+      }
 
-            do {
-              eeprom.write_low(state.recv_buff_low[i]);
+      if (state.recv_buff_pos > (state.chunk_header & 0x7F)) {
+        state.receiving_chunk = false;
+        state.receiving_crc   = true;
+        state.recv_buff_pos   = 0;
+      }
 
-            } while ((attempts++ < 20) && (eeprom.read_low() != state.recv_buff_low[i]));
+    } else if (state.receiving_crc) {
+      // Only a chunk that arrived intact takes its slot. One that didn't may have been the expected chunk with its index
+      // corrupted, so it is asked for again even if it was being dropped.
+      state.receiving_crc = false;
 
-            if (eeprom.read_low() != state.recv_buff_low[i]) {
-              Serial.write(0x0a);
-              Serial.write(i);
-              errors++;
-            } else {
-              Serial.write(0x0b);
-              Serial.write(i);
-            }
+      if (((data_high << 8) | data_low) != state.crc) {
+        resync();
 
-            eeprom.end_low();
-          }
+      } else if (state.dropping) {
+        state.dropping = false;
 
-          eeprom.next();
-        } while (i++ < 0xFF);  // TODO: This may vary
+        // The host sent the next chunk without holding a credit for it
+        if (state.chunk_index == state.chunk_count) {
+          Serial.write(0x03);
+          Serial.write(0x04);
 
-        Serial.write(0x07);
-        Serial.write(errors);
+          panic();
+        }
 
       } else {
-        state.recv_size--;
-        state.recv_buff_pos++;
+        state.chunks[state.chunk_fill].ready = true;
+
+        state.chunk_fill = (state.chunk_fill + 1) % chunk_slots;
+        state.chunk_count++;
       }
 
     } else if (state.receiving_flags) {
@@ -160,6 +716,37 @@ void loop() {
 
         case 0x01:
           state.sending = data_high;
+          state.writing = data_low;
+
+          state.recv_size--;
+          state.recv_buff_pos++;
+          break;
+
+        case 0x02:
+          if (data_high >= chip_profile_count) {
+            Serial.write(0x03);
+            Serial.write(0x03);
+
+            panic();
+          }
+
+          eeprom.profile = chip_profiles[data_high];
+          state.smart    = data_low;
+
+          state.recv_size--;
+          state.recv_buff_pos++;
+          break;
+
+        case 0x03:
+          // Last address of the chip, which has to be a whole number of 256 word blocks
+          eeprom.mask = (data_high << 8) | data_low;
+
+          if ((eeprom.mask & (eeprom.mask + 1)) != 0 || eeprom.mask < 0xFF) {
+            Serial.write(0x03);
+            Serial.write(0x05);
+
+            panic();
+          }
 
           state.recv_size     = 0;
           state.recv_buff_pos = 0;
@@ -167,6 +754,10 @@ void loop() {
           Serial.write(0x05);
           Serial.write(0x01);
 
+          // Every slot is free at this point
+          Serial.write(0x11);
+          Serial.write(chunk_slots);
+
           state.receiving_flags = false;
           break;
 
@@ -182,13 +773,37 @@ void loop() {
       }
 
     } else {
-      if (data_high == 0x02) {
+      if (data_high == 0x10 || data_high == 0x12) {
+        // The top bit marks the last chunk of the image, 0x12 chunks are compressed
+        state.receiving_index = true;
+        state.compressed      = data_high == 0x12;
+        state.chunk_header    = data_low;
+        state.crc             = 0x0000;
+        checksum(data_high, data_low);
+
+        if ((data_low & 0x7F) >= chunk_words) resync();
+
+      } else if (state.writing) {
+        // Most likely the start of a chunk that got corrupted on the way, none of the other packets has a CRC to
+        // tell
+        resync();
+
+      } else if (data_high == 0x02) {
         state.receiving_flags = true;
         state.recv_size       = data_low;
 
-      } else if (data_high == 0x06) {
-        state.receiving_data = true;
-        state.recv_size      = data_low;
+      } else if (data_high == 0x0c) {
+        negotiate_baud_rate(data_low);
+
+      } else if (data_high == 0x16) {
+        state.checksumming = true;
+
+      } else if (data_high == 0x14) {
+        state.rereading    = true;
+        state.reread_block = data_low;
+
+      } else if (data_high == 0x15) {
+        state.restarting = true;
 
       } else {
         Serial.write(0x03);
@@ -198,4 +813,6 @@ void loop() {
       }
     }
   }
+
+  receiving = false;
 }
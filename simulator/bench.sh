@@ -0,0 +1,106 @@
+#!/bin/bash
+# Flashes and reads back every test image through the simulator, printing the results as JSON.
+#
+# Usage: bench.sh SIMULATOR UPLOADER ROM_DIR [IMAGE_FILTER] [SIMULATOR_FLAGS...]
+
+set -u
+
+SIMULATOR=$1
+UPLOADER=$2
+ROM_DIR=$3
+FILTER=${4:-}
+shift 4 2>/dev/null || shift $#
+
+WORK_DIR=$(mktemp -d)
+LINK=$WORK_DIR/port
+STATS=$WORK_DIR/stats.jsonl
+
+for binary in "$SIMULATOR" "$UPLOADER"; do
+  if [ ! -x "$binary" ]; then
+    echo "[ERR] $binary is missing, build it first" >&2
+    exit 1
+  fi
+done
+
+"$SIMULATOR" --link="$LINK" --stats="$STATS" "$@" > "$WORK_DIR/simulator.log" 2>&1 &
+SIMULATOR_PID=$!
+trap 'kill $SIMULATOR_PID 2>/dev/null; wait $SIMULATOR_PID 2>/dev/null; rm -rf "$WORK_DIR"' EXIT
+
+while [ ! -e "$LINK" ]; do sleep 0.05; done
+touch "$STATS"
+
+now() { date +%s%N; }
+
+# Runs the uploader once and prints the JSON object describing the run
+run() {
+  local image=$1 mode=$2 action=$3 words=$4
+  shift 4
+
+  local sessions start end ok
+  sessions=$(wc -l < "$STATS")
+
+  # Keep the cache of the uploader out of the user's home, every write goes out in full anyway
+  start=$(now)
+  XDG_CACHE_HOME="$WORK_DIR" "$UPLOADER" --port="$LINK" "$@" > "$WORK_DIR/uploader.log" 2>&1
+  ok=$?
+  end=$(now)
+
+  while [ "$(wc -l < "$STATS")" -le "$sessions" ]; do sleep 0.01; done
+  local stats
+  stats=$(tail -n 1 "$STATS")
+
+  if [ "$action" = "read" ] && [ $ok -eq 0 ]; then
+    cmp -s "$WORK_DIR/readback.rom" "$ROM_DIR/$image.rom" || ok=1
+  fi
+
+  local rx tx cycles overruns
+  rx=$(sed -E 's/.*"bytes_rx": ([0-9]+).*/\1/' <<< "$stats")
+  tx=$(sed -E 's/.*"bytes_tx": ([0-9]+).*/\1/' <<< "$stats")
+  cycles=$(sed -E 's/.*"write_cycles": ([0-9]+).*/\1/' <<< "$stats")
+  overruns=$(sed -E 's/.*"overruns": ([0-9]+).*/\1/' <<< "$stats")
+
+  awk -v image="$image" -v mode="$mode" -v action="$action" -v words="$words" -v ns=$((end - start)) \
+      -v rx="$rx" -v tx="$tx" -v cycles="$cycles" -v overruns="$overruns" -v ok=$ok 'BEGIN {
+    seconds = ns / 1e9
+    printf "    {\"image\": \"%s\", \"mode\": \"%s\", \"action\": \"%s\", \"ok\": %s, \"seconds\": %.3f, ",
+           image, mode, action, ok == 0 ? "true" : "false", seconds
+    printf "\"wire_bytes\": %d, \"wire_bytes_per_second\": %.1f, \"words\": %d, \"words_per_second\": %.1f, ",
+           rx + tx, (rx + tx) / seconds, words, words / seconds
+    printf "\"write_cycles\": %d, \"overruns\": %d}", cycles, overruns
+  }'
+}
+
+first=true
+echo "{"
+echo "  \"runs\": ["
+
+for image in zero256 iters256 random256 zero512 iters512 random512; do
+  if [ -n "$FILTER" ] && [[ "$image" != *$FILTER* ]]; then continue; fi
+
+  if [[ "$image" == *256 ]]; then
+    modes="high low"
+  else
+    modes="dual"
+  fi
+
+  for mode in $modes; do
+    flags=()
+    [ "$mode" = "high" ] && flags=(--high)
+    [ "$mode" = "low" ] && flags=(--low)
+
+    for action in write read; do
+      $first || echo ","
+      first=false
+
+      if [ "$action" = "write" ]; then
+        run "$image" "$mode" "$action" 256 "${flags[@]}" --send="$ROM_DIR/$image.rom" --full
+      else
+        run "$image" "$mode" "$action" 256 "${flags[@]}" --receive="$WORK_DIR/readback.rom" --overwrite
+      fi
+    done
+  done
+done
+
+echo
+echo "  ]"
+echo "}"
@@ -0,0 +1,63 @@
+#ifndef _SIM_ARDUINO_H_
+#define _SIM_ARDUINO_H_
+
+// Host-side stand-in for the subset of the Arduino core used by the firmware.
+// Pin accesses are routed to the simulated board and Serial to the pseudo-terminal.
+
+#include <avr/io.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x0
+#define OUTPUT       0x1
+#define INPUT_PULLUP 0x2
+
+typedef uint8_t byte;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int  digitalRead(uint8_t pin);
+
+unsigned long millis();
+unsigned long micros();
+void          delay(unsigned long ms);
+void          delayMicroseconds(unsigned int us);
+void          yield();
+
+void cli();
+void sei();
+
+class HardwareSerial {
+ public:
+  void begin(unsigned long baud);
+  void end();
+
+  int available();
+  int availableForWrite();
+  int peek();
+  int read();
+
+  size_t readBytes(uint8_t* buffer, size_t length);
+  size_t readBytes(char* buffer, size_t length);
+  void   setTimeout(unsigned long timeout);
+
+  size_t write(uint8_t data);
+  size_t write(const uint8_t* buffer, size_t size);
+  void   flush();
+
+  operator bool() { return true; }
+
+ private:
+  unsigned long _timeout = 1000;
+};
+
+extern HardwareSerial Serial;
+
+void setup();
+void loop();
+
+#endif
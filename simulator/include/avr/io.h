@@ -0,0 +1,37 @@
+#ifndef _SIM_AVR_IO_H_
+#define _SIM_AVR_IO_H_
+
+#include <stdint.h>
+
+// Stand-ins for the ATmega328 I/O port registers. Reads and writes are translated into the matching Nano pins of the
+// simulated board, so code poking the registers directly behaves like it would on the real chip.
+
+#define SIM_PORT_B 0
+#define SIM_PORT_C 1
+#define SIM_PORT_D 2
+
+#define SIM_REGISTER_PIN  0
+#define SIM_REGISTER_DDR  1
+#define SIM_REGISTER_PORT 2
+
+class Register {
+ public:
+  constexpr Register(uint8_t port, uint8_t kind) : _port(port), _kind(kind) {}
+
+  operator uint8_t() const;
+  Register& operator=(uint8_t value);
+
+  Register& operator|=(uint8_t value) { return *this = *this | value; }
+  Register& operator&=(uint8_t value) { return *this = *this & value; }
+  Register& operator^=(uint8_t value) { return *this = *this ^ value; }
+
+ private:
+  uint8_t _port;
+  uint8_t _kind;
+};
+
+extern Register PINB, DDRB, PORTB;
+extern Register PINC, DDRC, PORTC;
+extern Register PIND, DDRD, PORTD;
+
+#endif
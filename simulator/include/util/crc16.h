@@ -0,0 +1,23 @@
+#ifndef _SIM_UTIL_CRC16_H_
+#define _SIM_UTIL_CRC16_H_
+
+// Host-side stand-in for the avr-libc CRC helpers, the C equivalents given in its documentation
+
+#include <stdint.h>
+
+// CRC-16/XMODEM: polynomial 0x1021, initial value 0x0000
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data) {
+  crc = crc ^ ((uint16_t)data << 8);
+
+  for (uint8_t i = 0; i < 8; i++) {
+    if (crc & 0x8000) {
+      crc = (crc << 1) ^ 0x1021;
+    } else {
+      crc <<= 1;
+    }
+  }
+
+  return crc;
+}
+
+#endif
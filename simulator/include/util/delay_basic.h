@@ -0,0 +1,11 @@
+#ifndef _SIM_UTIL_DELAY_BASIC_H_
+#define _SIM_UTIL_DELAY_BASIC_H_
+
+// Host-side stand-in for the avr-libc busy loops, which take a fixed number of cycles per iteration
+
+#include <stdint.h>
+
+void _delay_loop_1(uint8_t count);
+void _delay_loop_2(uint16_t count);
+
+#endif
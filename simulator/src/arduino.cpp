@@ -0,0 +1,174 @@
+#include <Arduino.h>
+
+#include <algorithm>
+
+#include <util/delay_basic.h>
+
+#include "board.hpp"
+#include "clock.hpp"
+#include "uart.hpp"
+
+HardwareSerial Serial;
+
+Register PINB(SIM_PORT_B, SIM_REGISTER_PIN), DDRB(SIM_PORT_B, SIM_REGISTER_DDR), PORTB(SIM_PORT_B, SIM_REGISTER_PORT);
+Register PINC(SIM_PORT_C, SIM_REGISTER_PIN), DDRC(SIM_PORT_C, SIM_REGISTER_DDR), PORTC(SIM_PORT_C, SIM_REGISTER_PORT);
+Register PIND(SIM_PORT_D, SIM_REGISTER_PIN), DDRD(SIM_PORT_D, SIM_REGISTER_DDR), PORTD(SIM_PORT_D, SIM_REGISTER_PORT);
+
+static const int64_t start_us = sim::now_us();
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  sim::tick();
+  sim::board().pin_mode(pin, mode);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  sim::tick();
+  sim::board().write(pin, val);
+}
+
+int digitalRead(uint8_t pin) {
+  sim::tick();
+  return sim::board().read(pin);
+}
+
+// Nano pin number of each bit of a port, port B and C only have six of them wired to pins
+static uint8_t register_pin(uint8_t port, uint8_t bit) {
+  switch (port) {
+    case SIM_PORT_B: return bit < 6 ? 8 + bit : sim::pin_count;
+    case SIM_PORT_C: return bit < 6 ? 14 + bit : sim::pin_count;
+    default: return bit;
+  }
+}
+
+Register::operator uint8_t() const {
+  sim::tick();
+
+  uint8_t value = 0;
+
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    uint8_t pin = register_pin(_port, bit);
+    if (pin >= sim::pin_count) continue;
+
+    bool set = false;
+
+    switch (_kind) {
+      case SIM_REGISTER_PIN: set = sim::board().read(pin); break;
+      case SIM_REGISTER_DDR: set = sim::board().mode(pin) == OUTPUT; break;
+      default: set = sim::board().level(pin); break;
+    }
+
+    if (set) value |= 1 << bit;
+  }
+
+  return value;
+}
+
+Register& Register::operator=(uint8_t value) {
+  sim::tick();
+
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    uint8_t pin = register_pin(_port, bit);
+    if (pin >= sim::pin_count) continue;
+
+    bool set = value & (1 << bit);
+
+    switch (_kind) {
+      case SIM_REGISTER_PIN:
+        // Writing a one to PINx toggles the output, like on the real chip
+        if (set) sim::board().write(pin, !sim::board().level(pin));
+        break;
+
+      case SIM_REGISTER_DDR: sim::board().pin_mode(pin, set ? OUTPUT : INPUT); break;
+      default: sim::board().write(pin, set ? HIGH : LOW); break;
+    }
+  }
+
+  return *this;
+}
+
+unsigned long millis() {
+  sim::tick();
+  return (sim::now_us() - start_us) / 1000;
+}
+
+unsigned long micros() {
+  sim::tick();
+  return sim::now_us() - start_us;
+}
+
+void delay(unsigned long ms) {
+  int64_t until = sim::now_us() + ms * 1000;
+
+  // Same as the AVR core, which keeps calling yield() while it waits
+  while (sim::now_us() < until) {
+    sim::tick();
+    yield();
+
+    int64_t wake = std::min<int64_t>(until, sim::now_us() + 100);
+
+    sim::block();
+    sim::sleep_until_us(wake);
+    sim::resume(wake);
+  }
+
+  sim::tick();
+}
+
+void delayMicroseconds(unsigned int us) {
+  int64_t until = sim::now_us() + us;
+
+  while (sim::now_us() < until) {
+    sim::tick();
+  }
+}
+
+// 3 and 4 cycles per iteration at F_CPU, rounded up to whole microseconds
+void _delay_loop_1(uint8_t count) { delayMicroseconds((count * 3 + F_CPU / 1000000 - 1) / (F_CPU / 1000000)); }
+void _delay_loop_2(uint16_t count) { delayMicroseconds((count * 4 + F_CPU / 1000000 - 1) / (F_CPU / 1000000)); }
+
+__attribute__((weak)) void yield() {}
+
+void cli() {}
+void sei() {}
+
+void HardwareSerial::begin(unsigned long baud) { sim::uart().begin(baud); }
+void HardwareSerial::end() { sim::uart().flush(); }
+
+int HardwareSerial::available() { return sim::uart().available(); }
+int HardwareSerial::availableForWrite() { return sim::uart().available_for_write(); }
+int HardwareSerial::peek() { return sim::uart().peek(); }
+int HardwareSerial::read() { return sim::uart().read(); }
+
+size_t HardwareSerial::readBytes(uint8_t* buffer, size_t length) {
+  size_t  count = 0;
+  int64_t until = sim::now_us() + _timeout * 1000;
+
+  while (count < length && sim::now_us() < until) {
+    int data = read();
+
+    if (data >= 0) {
+      buffer[count++] = data;
+      until           = sim::now_us() + _timeout * 1000;
+    }
+  }
+
+  return count;
+}
+
+size_t HardwareSerial::readBytes(char* buffer, size_t length) { return readBytes((uint8_t*)buffer, length); }
+void   HardwareSerial::setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+size_t HardwareSerial::write(uint8_t data) {
+  sim::uart().write(data);
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    sim::uart().write(buffer[i]);
+  }
+
+  return size;
+}
+
+void HardwareSerial::flush() { sim::uart().flush(); }
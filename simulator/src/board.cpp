@@ -0,0 +1,145 @@
+#include "board.hpp"
+
+#include <Arduino.h>
+
+#include <cstring>
+
+namespace sim {
+  static Board* current_board = nullptr;
+
+  Board& board() { return *current_board; }
+  void   set_board(Board* board) { current_board = board; }
+
+  void Board::init(uint8_t  address_bits,
+                   uint32_t size,
+                   uint32_t page_size,
+                   uint32_t high_write_cycle_us,
+                   uint32_t low_write_cycle_us) {
+    _counter_mask = (1u << address_bits) - 1;
+
+    high.in_pin         = pin_high_in;
+    high.out_pin        = pin_high_out;
+    high.en_pin         = pin_high_en;
+    high.size           = size;
+    high.page_size      = page_size;
+    high.write_cycle_us = high_write_cycle_us;
+
+    low.in_pin         = pin_low_in;
+    low.out_pin        = pin_low_out;
+    low.en_pin         = pin_low_en;
+    low.size           = size;
+    low.page_size      = page_size;
+    low.write_cycle_us = low_write_cycle_us;
+
+    memset(high.data, 0xFF, sizeof(high.data));
+    memset(low.data, 0xFF, sizeof(low.data));
+
+    // Control lines are active low and pulled up on the breadboard
+    _level[pin_high_in] = _level[pin_high_out] = _level[pin_high_en] = HIGH;
+    _level[pin_low_in] = _level[pin_low_out] = _level[pin_low_en] = HIGH;
+  }
+
+  void Board::pin_mode(uint8_t pin, uint8_t mode) {
+    if (pin < pin_count) _mode[pin] = mode;
+  }
+
+  void Board::write(uint8_t pin, uint8_t level) {
+    if (pin >= pin_count) return;
+
+    level = level ? HIGH : LOW;
+
+    if (_level[pin] != level) {
+      _level[pin] = level;
+      on_edge(pin, level);
+    }
+  }
+
+  uint8_t Board::read(uint8_t pin) {
+    if (pin >= pin_count) return LOW;
+
+    if (_mode[pin] == OUTPUT) return _level[pin];
+
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      if (pin_data[bit] == pin) {
+        return (bus() >> bit) & 0x01;
+      }
+    }
+
+    return _level[pin];
+  }
+
+  void Board::on_edge(uint8_t pin, uint8_t level) {
+    if (pin == pin_addr_clk && level == HIGH && _level[pin_addr_next] == HIGH) {
+      counter = (counter + 1) & _counter_mask;
+      return;
+    }
+
+    on_chip_edge(high, pin, level);
+    on_chip_edge(low, pin, level);
+  }
+
+  void Board::on_chip_edge(chip_t& chip, uint8_t pin, uint8_t level) {
+    // Data is latched on the rising edge of whichever of WE# or CE# goes high first
+    if (pin == chip.in_pin && level == HIGH && _level[chip.en_pin] == LOW) latch(chip);
+    if (pin == chip.en_pin && level == HIGH && _level[chip.in_pin] == LOW) latch(chip);
+
+    // Every status read while a write cycle is in progress flips the toggle bit
+    if (pin == chip.out_pin && level == LOW && _level[chip.en_pin] == LOW && now_us() < chip.busy_until) {
+      chip.toggle = !chip.toggle;
+    }
+  }
+
+  void Board::latch(chip_t& chip) {
+    int64_t  now     = now_us();
+    uint32_t address = counter & (chip.size - 1);
+    uint32_t page    = address & ~(chip.page_size - 1);
+    bool     loading = now < chip.load_until;
+
+    // Writes issued during an internal write cycle are ignored by the chip, and so are bytes outside the page that
+    // is being loaded
+    if (now < chip.busy_until && !loading) return;
+    if (loading && page != chip.page) return;
+
+    if (!loading) {
+      chip.page   = page;
+      chip.toggle = false;
+      chip.write_cycles++;
+      stats.write_cycles++;
+    }
+
+    // Every byte loaded into the page restarts the load window, the whole page is written in a single cycle after it
+    chip.last_write    = bus();
+    chip.data[address] = chip.last_write;
+    chip.load_until    = chip.page_size > 1 ? now + page_load_us : now;
+    chip.busy_until    = chip.load_until + chip.write_cycle_us;
+  }
+
+  bool Board::driving(const chip_t& chip) const {
+    return _level[chip.en_pin] == LOW && _level[chip.out_pin] == LOW && _level[chip.in_pin] == HIGH;
+  }
+
+  uint8_t Board::output(const chip_t& chip) const {
+    // DATA# polling: bit 7 reads inverted and bit 6 toggles until the write cycle completes
+    if (now_us() < chip.busy_until) {
+      return (~chip.last_write & 0x80) | (chip.toggle ? 0x40 : 0x00) | (chip.last_write & 0x3F);
+    }
+
+    return chip.data[counter & (chip.size - 1)];
+  }
+
+  uint8_t Board::bus() const {
+    uint8_t value = 0xFF;
+
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      uint8_t pin = pin_data[bit];
+
+      if (_mode[pin] == OUTPUT && !_level[pin]) value &= ~(1 << bit);
+    }
+
+    // Chips pull the bus low against anything else driving it, which is what contention would look like
+    if (driving(high)) value &= output(high);
+    if (driving(low)) value &= output(low);
+
+    return value;
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef _SIM_BOARD_HPP_
+#define _SIM_BOARD_HPP_
+
+#include <cstdint>
+
+#include "clock.hpp"
+
+namespace sim {
+  // Wiring of the breadboard, must match the EEPROM instance in microcontroller.cpp
+  constexpr uint8_t pin_addr_clk  = 14;
+  constexpr uint8_t pin_addr_next = 13;
+  constexpr uint8_t pin_low_in    = 9;
+  constexpr uint8_t pin_low_out   = 10;
+  constexpr uint8_t pin_low_en    = 12;
+  constexpr uint8_t pin_high_in   = 2;
+  constexpr uint8_t pin_high_out  = 3;
+  constexpr uint8_t pin_high_en   = 11;
+  constexpr uint8_t pin_data[8]   = {17, 16, 15, 8, 7, 6, 5, 4};
+
+  constexpr uint8_t  pin_count     = 20;
+  constexpr uint32_t max_chip_size = 0x8000;
+
+  // Byte load cycle of page mode chips, the write cycle starts once no new byte arrived for this long (tBLC)
+  constexpr int64_t page_load_us = 150;
+
+  typedef struct chip_t {
+    uint8_t in_pin  = 0;
+    uint8_t out_pin = 0;
+    uint8_t en_pin  = 0;
+
+    uint32_t size           = 0x100;
+    uint32_t page_size      = 1;
+    uint32_t write_cycle_us = 10000;
+
+    int64_t  load_until = 0;
+    int64_t  busy_until = 0;
+    uint32_t page       = 0;
+    uint8_t  last_write = 0x00;
+    bool     toggle     = false;
+
+    uint32_t write_cycles = 0;
+    uint8_t  data[max_chip_size];
+  } chip_t;
+
+  typedef struct stats_t {
+    uint32_t sessions     = 0;
+    uint32_t bytes_rx     = 0;
+    uint32_t bytes_tx     = 0;
+    uint32_t rx_overruns  = 0;
+    uint32_t write_cycles = 0;
+  } stats_t;
+
+  // Models the address counter and the two parallel EEPROMs sharing the data bus. It is placed in shared memory
+  // so that the chips keep their contents across the per-session firmware processes.
+  class Board {
+   public:
+    void init(uint8_t  address_bits,
+              uint32_t size,
+              uint32_t page_size,
+              uint32_t high_write_cycle_us,
+              uint32_t low_write_cycle_us);
+
+    void    pin_mode(uint8_t pin, uint8_t mode);
+    void    write(uint8_t pin, uint8_t level);
+    uint8_t read(uint8_t pin);
+
+    uint8_t mode(uint8_t pin) const { return pin < pin_count ? _mode[pin] : 0; }
+    uint8_t level(uint8_t pin) const { return pin < pin_count ? _level[pin] : 0; }
+
+    chip_t  high;
+    chip_t  low;
+    stats_t stats;
+
+    uint32_t counter = 0;
+
+   private:
+    void    on_edge(uint8_t pin, uint8_t level);
+    void    on_chip_edge(chip_t& chip, uint8_t pin, uint8_t level);
+    void    latch(chip_t& chip);
+    bool    driving(const chip_t& chip) const;
+    uint8_t output(const chip_t& chip) const;
+    uint8_t bus() const;
+
+    uint32_t _counter_mask = 0xFF;
+
+    uint8_t _mode[pin_count]  = {};
+    uint8_t _level[pin_count] = {};
+  };
+
+  Board& board();
+  void   set_board(Board* board);
+}
+
+#endif
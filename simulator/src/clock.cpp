@@ -0,0 +1,59 @@
+#include "clock.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace sim {
+  static std::atomic<int64_t> stalled_us {0};
+  static std::atomic<int64_t> last_tick_us {0};
+  static std::atomic<bool>    blocking {false};
+
+  static int64_t monotonic_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Part of a stall that is still going on, or that the firmware hasn't noticed yet. It is cut from every reading
+  // straight away, otherwise a reading taken between a tick() and the preemption right after it would run ahead.
+  static int64_t pending_us(int64_t now) {
+    int64_t last = last_tick_us;
+
+    if (blocking || last == 0 || now - last <= stall_threshold_us) return 0;
+
+    return now - last - stall_threshold_us;
+  }
+
+  int64_t now_us() {
+    int64_t now = monotonic_us();
+    return now - stalled_us - pending_us(now);
+  }
+
+  int64_t host_us(int64_t controller_us) { return controller_us + stalled_us; }
+
+  void tick() {
+    int64_t now = monotonic_us();
+
+    stalled_us += pending_us(now);
+    last_tick_us = now;
+  }
+
+  void block() { blocking = true; }
+
+  void resume(int64_t controller_us) {
+    int64_t now  = monotonic_us();
+    int64_t late = now - host_us(controller_us);
+
+    if (late > stall_threshold_us) stalled_us += late - stall_threshold_us;
+
+    last_tick_us = now;
+    blocking     = false;
+  }
+
+  void sleep_until_us(int64_t controller_us) {
+    int64_t delta = host_us(controller_us) - monotonic_us();
+    if (delta > 0) std::this_thread::sleep_for(std::chrono::microseconds(delta));
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef _SIM_CLOCK_HPP_
+#define _SIM_CLOCK_HPP_
+
+#include <cstdint>
+
+namespace sim {
+  // Longest gap between two calls into the Arduino core that still counts as the firmware running
+  constexpr int64_t stall_threshold_us = 20;
+
+  // Time as seen by the controller, in microseconds. The real controller never stops, but the simulated one can be
+  // preempted by the host for whole scheduler slices, so gaps where the firmware didn't get to run at all are cut out
+  // instead of letting the UART overrun during them.
+  int64_t now_us();
+
+  // Host time at which the controller clock reaches the given value
+  int64_t host_us(int64_t controller_us);
+
+  // Must be called by every firmware facing entry point, this is what detects the stalls
+  void tick();
+
+  // Must be called around every wait the firmware does on purpose, with the controller time it meant to block until.
+  // The wait itself doesn't count as a stall, but oversleeping it does.
+  void block();
+  void resume(int64_t controller_us);
+
+  void sleep_until_us(int64_t controller_us);
+}
+
+#endif
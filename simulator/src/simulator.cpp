@@ -0,0 +1,248 @@
+// Arduino stand-in
+#include <Arduino.h>
+
+#include "board.hpp"
+#include "uart.hpp"
+
+// POSIX
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Formatting
+#include <fmt/core.h>
+
+// STL
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+// Argument parser
+#include <stypox/argparser.hpp>
+namespace sp = stypox;
+
+typedef struct args_t {
+  std::string link  = "";
+  std::string stats = "";
+
+  uint16_t address_bits = 8;
+  uint32_t size         = 256;
+  uint32_t page_size    = 1;
+  uint32_t high_twc     = 10000;
+  uint32_t low_twc      = 10000;
+  uint32_t boot_delay   = 0;
+  uint32_t rx_noise     = 0;
+  uint32_t tx_noise     = 0;
+
+  bool help    = false;
+  bool verbose = false;
+} args_t;
+
+args_t args;
+
+volatile sig_atomic_t running = true;
+
+void stop(int) { running = false; }
+
+int  open_pty(std::string& name);
+bool wait_for_host(int master);
+void run_firmware(int master);
+void write_stats(const sim::stats_t& session);
+
+int main(int argc, const char* argv[]) {
+  sp::ArgParser parser {
+      std::make_tuple(
+          sp::HelpSection("\nAvailable options:"),
+          sp::SwitchOption {"help", args.help, sp::args("-?", "--help"), "Show help options"},
+          sp::SwitchOption {"verbose", args.verbose, sp::args("-v", "--verbose"), "Use verbose mode"},
+          sp::Option {"link", args.link, sp::args("-l", "--link"), "Symlink to create for the pty"},
+          sp::Option {"stats", args.stats, sp::args("-S", "--stats"), "File to append session statistics to"},
+          sp::Option {"bits", args.address_bits, sp::args("-b", "--bits="), "Width of the address counter"},
+          sp::Option {"size", args.size, sp::args("-s", "--size="), "Size of each EEPROM in bytes"},
+          sp::Option {"page", args.page_size, sp::args("-P", "--page-size="), "Page size of each EEPROM, 1 for none"},
+          sp::Option {"htwc", args.high_twc, sp::args("-H", "--high-twc="), "Write cycle of the high EEPROM in us"},
+          sp::Option {"ltwc", args.low_twc, sp::args("-L", "--low-twc="), "Write cycle of the low EEPROM in us"},
+          sp::Option {"boot", args.boot_delay, sp::args("-B", "--boot-delay="), "Bootloader delay after reset in ms"},
+          sp::Option {"rxnoise", args.rx_noise, sp::args("-N", "--rx-noise="), "Corrupt one in this many bytes received"},
+          sp::Option {"txnoise", args.tx_noise, sp::args("-T", "--tx-noise="), "Corrupt one in this many bytes sent"}),
+      "Very Simple Architecture EEPROM Programmer Simulator\n"};
+
+  try {
+    parser.parse(argc, argv);
+  } catch (std::runtime_error& err) {
+    std::cout << err.what() << std::endl;
+    exit(1);
+  }
+
+  if (args.help) {
+    std::cout << parser.help();
+    exit(0);
+  }
+
+  if (args.link.starts_with('=')) {
+    args.link.erase(args.link.begin());
+  }
+
+  if (args.stats.starts_with('=')) {
+    args.stats.erase(args.stats.begin());
+  }
+
+  if (args.address_bits < 1 || args.address_bits > 16 || args.size > sim::max_chip_size ||
+      (args.size & (args.size - 1)) != 0 || args.page_size < 1 || args.page_size > args.size ||
+      (args.page_size & (args.page_size - 1)) != 0) {
+    fmt::print("[ERR] Invalid address counter width, EEPROM size or page size\n");
+    exit(1);
+  }
+
+  // The board outlives every firmware process, just like the real chips keep their contents across resets
+  void* memory = mmap(nullptr, sizeof(sim::Board), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (memory == MAP_FAILED) {
+    fmt::print("[ERR] Couldn't allocate board memory\n");
+    exit(2);
+  }
+
+  sim::Board* board = new (memory) sim::Board {};
+  board->init(args.address_bits, args.size, args.page_size, args.high_twc, args.low_twc);
+  sim::set_board(board);
+
+  std::string name;
+  int         master = open_pty(name);
+
+  if (master < 0) {
+    fmt::print("[ERR] Couldn't open pseudo-terminal\n");
+    exit(3);
+  }
+
+  if (!args.link.empty()) {
+    unlink(args.link.c_str());
+
+    if (symlink(name.c_str(), args.link.c_str()) != 0) {
+      fmt::print("[ERR] Couldn't create link {}\n", args.link);
+      exit(4);
+    }
+  }
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  fmt::print("[INF] Controller listening on {}\n", args.link.empty() ? name : args.link);
+  std::cout.flush();
+
+  while (running) {
+    if (!wait_for_host(master)) break;
+
+    sim::stats_t before = board->stats;
+    board->stats.sessions++;
+
+    if (args.verbose) fmt::print("[INF] Host connected, resetting controller\n");
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+      run_firmware(master);
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+      if (!running) kill(pid, SIGTERM);
+    }
+
+    tcflush(master, TCIOFLUSH);
+
+    sim::stats_t session {
+        board->stats.sessions,
+        board->stats.bytes_rx - before.bytes_rx,
+        board->stats.bytes_tx - before.bytes_tx,
+        board->stats.rx_overruns - before.rx_overruns,
+        board->stats.write_cycles - before.write_cycles,
+    };
+
+    fmt::print("[INF] Session {} ended: {} bytes received, {} bytes sent, {} write cycles, {} overruns\n",
+               session.sessions,
+               session.bytes_rx,
+               session.bytes_tx,
+               session.write_cycles,
+               session.rx_overruns);
+    std::cout.flush();
+
+    if (!args.stats.empty()) write_stats(session);
+  }
+
+  if (!args.link.empty()) unlink(args.link.c_str());
+  close(master);
+
+  return 0;
+}
+
+int open_pty(std::string& name) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) return -1;
+
+  name = ptsname(master);
+
+  termios tty;
+  tcgetattr(master, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(master, TCSANOW, &tty);
+
+  // The master only reports a hangup once the slave has been opened and closed at least once
+  int slave = open(name.c_str(), O_RDWR | O_NOCTTY);
+  if (slave < 0) return -1;
+  close(slave);
+
+  return master;
+}
+
+bool wait_for_host(int master) {
+  while (running) {
+    pollfd fds {master, POLLIN, 0};
+    poll(&fds, 1, 0);
+
+    if (!(fds.revents & POLLHUP)) return true;
+
+    std::this_thread::sleep_for(10ms);
+  }
+
+  return false;
+}
+
+void run_firmware(int master) {
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  // Opening the port toggles DTR, which resets the Nano into its bootloader first
+  std::this_thread::sleep_for(std::chrono::milliseconds(args.boot_delay));
+
+  sim::uart().set_noise(args.rx_noise, args.tx_noise);
+  sim::uart().start(master);
+
+  setup();
+
+  while (true) {
+    loop();
+  }
+}
+
+void write_stats(const sim::stats_t& session) {
+  std::ofstream statsf(args.stats, std::ofstream::app);
+
+  // One JSON object per line, so the benchmark can pick up the session that just ended
+  statsf << fmt::format(
+      "{{\"session\": {}, \"bytes_rx\": {}, \"bytes_tx\": {}, \"write_cycles\": {}, \"overruns\": {}}}\n",
+      session.sessions,
+      session.bytes_rx,
+      session.bytes_tx,
+      session.write_cycles,
+      session.rx_overruns);
+}
@@ -0,0 +1,239 @@
+#include "uart.hpp"
+
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "board.hpp"
+
+namespace sim {
+  static Uart current_uart;
+
+  Uart& uart() { return current_uart; }
+
+  static speed_t speed_for(unsigned long baud) {
+    switch (baud) {
+      case 9600: return B9600;
+      case 115200: return B115200;
+      case 500000: return B500000;
+      case 1000000: return B1000000;
+      default: return B0;
+    }
+  }
+
+  // What a byte looks like when sampled at the wrong rate, any corruption will do as long as it is consistent
+  static uint8_t garble(uint8_t data) { return data ^ 0x5a; }
+
+  void Uart::start(int fd) {
+    _fd = fd;
+
+    _rx_thread = std::thread(&Uart::receiver, this);
+    _tx_thread = std::thread(&Uart::transmitter, this);
+
+    _rx_thread.detach();
+    _tx_thread.detach();
+  }
+
+  void Uart::begin(unsigned long baud) {
+    tick();
+
+    flush();
+
+    std::lock_guard<std::mutex> guard(_lock);
+    _baud = baud;
+  }
+
+  int Uart::available() {
+    tick();
+
+    std::lock_guard<std::mutex> guard(_lock);
+    deliver(now_us());
+
+    return _rx_buffer.size();
+  }
+
+  int Uart::available_for_write() {
+    tick();
+
+    std::lock_guard<std::mutex> guard(_lock);
+
+    return uart_buffer_size - std::min(_tx_wire.size(), uart_buffer_size);
+  }
+
+  int Uart::peek() {
+    tick();
+
+    std::lock_guard<std::mutex> guard(_lock);
+    deliver(now_us());
+
+    return _rx_buffer.empty() ? -1 : _rx_buffer.front();
+  }
+
+  int Uart::read() {
+    tick();
+
+    std::lock_guard<std::mutex> guard(_lock);
+    deliver(now_us());
+
+    if (_rx_buffer.empty()) return -1;
+
+    uint8_t data = _rx_buffer.front();
+    _rx_buffer.pop_front();
+
+    return data;
+  }
+
+  void Uart::write(uint8_t data) {
+    tick();
+
+    int64_t now = now_us();
+    int64_t due = 0;
+
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+
+      due      = std::max(now, _tx_last) + byte_time();
+      _tx_last = due;
+      _tx_wire.emplace_back(due, data);
+    }
+
+    _tx_ready.notify_one();
+
+    // Block like HardwareSerial::write does while the transmit buffer is full
+    int64_t until = std::max(now, due - static_cast<int64_t>(uart_buffer_size * byte_time()));
+
+    block();
+    sleep_until_us(until);
+    resume(until);
+  }
+
+  void Uart::flush() {
+    tick();
+
+    std::unique_lock<std::mutex> guard(_lock);
+    int64_t                      until = std::max(now_us(), _tx_last);
+
+    block();
+    _tx_drained.wait(guard, [this] { return _tx_wire.empty(); });
+    resume(until);
+  }
+
+  void Uart::deliver(int64_t now) {
+    while (!_rx_wire.empty() && _rx_wire.front().due <= now) {
+      const rx_byte_t& byte = _rx_wire.front();
+
+      if (_rx_buffer.size() < uart_buffer_size) {
+        _rx_buffer.push_back(noise(in_sync(byte.speed) ? byte.data : garble(byte.data), _rx_noise));
+      } else {
+        board().stats.rx_overruns++;
+      }
+
+      _rx_wire.pop_front();
+    }
+  }
+
+  bool Uart::in_sync() const {
+    // Both ends of a pseudo-terminal share their settings, so this is the rate the host configured
+    termios tty;
+    if (tcgetattr(_fd, &tty) != 0) return true;
+
+    return in_sync(cfgetospeed(&tty));
+  }
+
+  bool Uart::in_sync(unsigned int speed) const { return speed == speed_for(_baud); }
+
+  void Uart::set_noise(uint32_t rx_one_in, uint32_t tx_one_in) {
+    _rx_noise = rx_one_in;
+    _tx_noise = tx_one_in;
+
+    // Every session is its own process, which shouldn't all hit the same bytes
+    _random.seed(getpid());
+  }
+
+  uint8_t Uart::noise(uint8_t data, uint32_t one_in) {
+    if (one_in == 0 || _random() % one_in != 0) return data;
+
+    return data ^ (1 << (_random() % 8));
+  }
+
+  void Uart::receiver() {
+    uint8_t buffer[256];
+
+    while (true) {
+      pollfd fds {_fd, POLLIN, 0};
+
+      if (poll(&fds, 1, -1) < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+
+      // The host closed the port, which is where the session ends
+      if (fds.revents & (POLLHUP | POLLERR)) break;
+
+      ssize_t count = ::read(_fd, buffer, sizeof(buffer));
+      if (count <= 0) break;
+
+      termios tty;
+      tcgetattr(_fd, &tty);
+
+      std::lock_guard<std::mutex> guard(_lock);
+      int64_t                     now   = now_us();
+      speed_t                     speed = cfgetospeed(&tty);
+
+      for (ssize_t i = 0; i < count; i++) {
+        _rx_last = std::max(now, _rx_last) + byte_time();
+        _rx_wire.push_back({_rx_last, buffer[i], speed});
+      }
+
+      board().stats.bytes_rx += count;
+    }
+
+    _exit(0);
+  }
+
+  void Uart::transmitter() {
+    uint8_t buffer[uart_buffer_size];
+
+    while (true) {
+      int64_t due = 0;
+
+      {
+        std::unique_lock<std::mutex> guard(_lock);
+        _tx_ready.wait(guard, [this] { return !_tx_wire.empty(); });
+
+        due = _tx_wire.front().first;
+      }
+
+      sleep_until_us(due);
+
+      size_t count = 0;
+
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        int64_t                     now  = now_us();
+        bool                        sync = in_sync();
+
+        while (!_tx_wire.empty() && _tx_wire.front().first <= now && count < sizeof(buffer)) {
+          buffer[count++] = noise(sync ? _tx_wire.front().second : garble(_tx_wire.front().second), _tx_noise);
+          _tx_wire.pop_front();
+        }
+
+        // Counted before the host can see them, the session ends as soon as it closes the port after the last byte
+        board().stats.bytes_tx += count;
+      }
+
+      // The pty only takes as much as fits in its buffer when the host is slow to read
+      for (size_t written = 0; written < count;) {
+        ssize_t result = ::write(_fd, buffer + written, count - written);
+
+        if (result < 0 && errno != EINTR) break;
+        if (result > 0) written += result;
+      }
+
+      _tx_drained.notify_all();
+    }
+  }
+}
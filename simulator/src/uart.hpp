@@ -0,0 +1,79 @@
+#ifndef _SIM_UART_HPP_
+#define _SIM_UART_HPP_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+
+namespace sim {
+  // Size of the HardwareSerial ring buffers on the ATmega328
+  constexpr size_t uart_buffer_size = 64;
+
+  // Models the UART of the controller on top of a pseudo-terminal master. Bytes written by the host only become
+  // visible to the firmware after their wire time at the current baud rate, and get dropped when the 64 byte receive
+  // buffer is full, just like on the real hardware. Transmission is paced the same way, and bytes get garbled in both
+  // directions while the host and the firmware disagree on the baud rate.
+  class Uart {
+   public:
+    void start(int fd);
+
+    void begin(unsigned long baud);
+
+    // Flip a random bit in about one of every so many bytes coming from and going to the host, 0 for a clean line
+    void set_noise(uint32_t rx_one_in, uint32_t tx_one_in);
+
+    int  available();
+    int  available_for_write();
+    int  peek();
+    int  read();
+    void write(uint8_t data);
+    void flush();
+
+   private:
+    // A byte on its way to the firmware, along with the rate the host sent it at. Whether it arrives intact is only
+    // decided once the firmware picks it up, as the firmware may not have switched rates yet when the host already has.
+    typedef struct rx_byte_t {
+      int64_t      due;
+      uint8_t      data;
+      unsigned int speed;
+    } rx_byte_t;
+
+    void receiver();
+    void transmitter();
+    void deliver(int64_t now);
+    bool in_sync() const;
+    bool in_sync(unsigned int speed) const;
+    uint8_t noise(uint8_t data, uint32_t one_in);
+
+    int64_t byte_time() const { return 10000000 / _baud; }
+
+    int           _fd   = -1;
+    unsigned long _baud = 9600;
+
+    uint32_t         _rx_noise = 0;
+    uint32_t         _tx_noise = 0;
+    std::minstd_rand _random;
+
+    std::mutex              _lock;
+    std::condition_variable _tx_ready;
+    std::condition_variable _tx_drained;
+
+    int64_t               _rx_last = 0;
+    std::deque<rx_byte_t> _rx_wire;
+    std::deque<uint8_t>   _rx_buffer;
+
+    int64_t                                 _tx_last = 0;
+    std::deque<std::pair<int64_t, uint8_t>> _tx_wire;
+
+    std::thread _rx_thread;
+    std::thread _tx_thread;
+  };
+
+  Uart& uart();
+}
+
+#endif
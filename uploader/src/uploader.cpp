@@ -6,13 +6,30 @@ namespace ls = LibSerial;
 #include <fmt/color.h>
 #include <fmt/core.h>
 
+// POSIX
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 // STL
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <thread>
+#include <utility>
+#include <vector>
 
 using namespace std::chrono_literals;
 
@@ -20,7 +37,37 @@ using namespace std::chrono_literals;
 #include <stypox/argparser.hpp>
 namespace sp = stypox;
 
-constexpr uint8_t version = 0x02;
+constexpr uint8_t version = 0x10;
+
+// Must match the table in the controller, the index is what goes over the wire in the 0x0c packet
+constexpr std::pair<uint32_t, ls::BaudRate> baud_rates[] = {
+    {9600, ls::BaudRate::BAUD_9600},
+    {115200, ls::BaudRate::BAUD_115200},
+    {500000, ls::BaudRate::BAUD_500000},
+    {1000000, ls::BaudRate::BAUD_1000000},
+};
+
+constexpr uint8_t baud_rate_count = sizeof(baud_rates) / sizeof(baud_rates[0]);
+
+// Timing profiles known to the controller and the number of words of each chip, the index is sent along with the
+// flags
+constexpr std::pair<std::string_view, uint32_t> chip_profiles[] = {
+    {"generic", 256},
+    {"28C16", 2048},
+    {"28C64", 8192},
+    {"28C256", 32768},
+};
+
+constexpr uint8_t chip_profile_count = sizeof(chip_profiles) / sizeof(chip_profiles[0]);
+
+// Writes are streamed in chunks of at most this many words, aligned so that a page never spans two of them
+constexpr uint8_t chunk_words = 64;
+
+// Chunk buffers of the controller, never more chunks than this are in flight whatever the 0x11 and 0x13 packets say
+constexpr uint8_t chunk_slots = 2;
+
+// Times the same chunk or read block may arrive corrupted before giving up on the line
+constexpr uint8_t max_retries = 8;
 
 typedef struct state_t {
   bool receiving = false;
@@ -32,31 +79,111 @@ typedef struct state_t {
   bool handshake = false;
   bool debug     = false;
   bool waiting   = false;
-
-  uint16_t total_bytes   = 0;
-  uint16_t written_bytes = 0;
-  uint16_t error_bytes   = 0;
-
-  uint8_t recv_size             = 0x00;
-  uint8_t recv_buffer_pos       = 0x00;
-  uint8_t recv_buffer_high[256] = {};
-  uint8_t recv_buffer_low[256]  = {};
-
-  uint8_t send_size             = 0x00;
-  uint8_t send_buffer_pos       = 0x00;
-  uint8_t send_buffer_high[256] = {};
-  uint8_t send_buffer_low[256]  = {};
+  bool testing   = false;
+  bool summary   = false;
+
+  uint8_t baud_rate     = 0x00;
+  uint8_t baud_proposed = 0x00;
+
+  std::chrono::steady_clock::time_point test_deadline {};
+  std::chrono::steady_clock::time_point deadline {};
+
+  uint32_t total_bytes   = 0;
+  uint32_t written_bytes = 0;
+  uint32_t error_bytes   = 0;
+
+  // Failure bitmap of a chunk being received: 0x09 for the high chip or 0x0a for the low one, 0x00 if none, then its
+  // size, the word being read and the start address of the chunk
+  uint8_t  failed       = 0x00;
+  uint8_t  failed_size  = 0x00;
+  uint8_t  failed_pos   = 0x00;
+  uint16_t failed_start = 0x0000;
+
+  // Addresses that couldn't be written, only listed once the write is done
+  std::vector<uint16_t> failed_high;
+  std::vector<uint16_t> failed_low;
+
+  // Chunks the controller is done with, which is all the progress it reports
+  size_t chunks_done = 0;
+  bool   granted     = false;
+
+  // Words of the 0x07 write summary, two for each count: errors, then bytes skipped because they already matched
+  uint8_t  summary_size     = 0x00;
+  uint8_t  summary_pos      = 0x00;
+  uint32_t summary_words[2] = {};
+
+  // Reads arrive in blocks of 256 words followed by their CRC, the ones that got corrupted are read again at the end
+  uint8_t              recv_size       = 0x00;
+  uint32_t             recv_buffer_pos = 0x00;
+  std::vector<uint8_t> recv_buffer_high;
+  std::vector<uint8_t> recv_buffer_low;
+  bool                 recv_checking = false;
+  bool                 rereading     = false;
+  bool                 block_next    = false;
+  uint16_t             recv_crc      = 0x0000;
+  uint8_t              recv_block    = 0x00;
+  std::deque<uint8_t>  bad_blocks;
+
+  // CRC-32 of every block as the controller computed it, two words each. Blocks that don't match the image are read
+  // back with 0x14 to tell which words differ.
+  bool                  checksums      = false;
+  uint16_t              checksums_size = 0;
+  uint16_t              checksums_pos  = 0;
+  std::vector<uint32_t> block_checksums;
+  std::deque<uint8_t>   diff_blocks;
+  std::vector<uint8_t>  mismatched;
+
+  std::vector<uint8_t> send_buffer_high;
+  std::vector<uint8_t> send_buffer_low;
+
+  // Words a sparse image sets on each chip, empty for raw images which set all of them. What the chips hold
+  // elsewhere is only known from the cache.
+  std::vector<bool> populated_high;
+  std::vector<bool> populated_low;
+  bool              partial = false;
+
+  // What the chips held after the last successful write
+  std::vector<uint8_t> cache_buffer_high;
+  std::vector<uint8_t> cache_buffer_low;
+
+  // Chunks to stream as start address and number of words, how many went out and how many of them the controller
+  // has room for at once
+  std::vector<std::pair<uint16_t, uint8_t>> chunks;
+  size_t                                    chunks_sent = 0;
+  uint8_t                                   slots       = 0;
+
+  // Bytes the chunks took on the wire and what they would have taken uncompressed
+  uint32_t chunk_bytes = 0;
+  uint32_t raw_bytes   = 0;
+
+  // Chunks and blocks that arrived corrupted and had to be sent again, and how often in a row for the last one
+  uint32_t retries       = 0;
+  size_t   retry_index   = 0;
+  uint8_t  retry_attempt = 0;
 } state_t;
 
 typedef struct args_t {
   std::string port         = "";
   std::string send_file    = "";
   std::string receive_file = "";
+  std::string verify_file  = "";
+  std::string chip         = "generic";
+  std::string tag          = "";
+  std::string daemon       = "";
+  std::string manifest     = "";
+
+  uint32_t baud         = 1000000;
+  uint32_t size         = 0;
+  uint32_t wait         = 0;
+  uint8_t  chip_profile = 0x00;
 
   bool help      = false;
   bool high      = false;
   bool low       = false;
   bool overwrite = false;
+  bool smart     = false;
+  bool full      = false;
+  bool compress  = false;
   bool verbose   = false;
   bool debug     = false;
 } args_t;
@@ -64,9 +191,54 @@ typedef struct args_t {
 state_t state;
 args_t  args;
 
-void send_word(ls::SerialPort& port, uint8_t data_high, uint8_t data_low);
-
-int main(int argc, const char* argv[]) {
+// Port held open by the daemon, every job runs its session on it without resetting the controller. Never closed on
+// exit, since the job processes share it.
+ls::SerialPort* held_port = nullptr;
+std::string     held_name = "";
+
+void                      send_word(ls::SerialPort& port, uint8_t data_high, uint8_t data_low);
+void                      send_frame(ls::SerialPort& port, const ls::DataBuffer& frame);
+void                      send_chunk(ls::SerialPort& port, size_t index);
+void                      add_chunks(uint16_t start, uint32_t length);
+ls::DataBuffer            compress_chunk(uint16_t start, uint8_t length);
+uint16_t                  crc16(uint16_t crc, uint8_t data);
+uint32_t                  crc32(uint32_t crc, uint8_t data);
+uint32_t                  block_checksum(uint8_t block);
+void                      request_block(ls::SerialPort& port, uint8_t block);
+bool                      retry(size_t index);
+std::string               address_ranges(const std::vector<uint16_t>& addresses);
+bool                      compare(const std::vector<uint8_t>& blocks, std::string_view image);
+void                      load_raw(const std::string& image);
+void                      load_records(std::ifstream& sendf, const std::string& image);
+char                      record_start(const std::string& path);
+bool                      populated(uint32_t word);
+std::string               hexdump(const ls::DataBuffer& data);
+bool                      receive(ls::SerialPort& port, ls::DataBuffer& buffer, size_t& position);
+std::chrono::milliseconds phase_timeout();
+std::string_view          phase_name();
+void                      send_flags(ls::SerialPort& port);
+void                      propose_baud_rate(ls::SerialPort& port, uint8_t rate);
+void                      switch_baud_rate(ls::SerialPort& port, uint8_t rate);
+std::vector<std::string>  expand_ports(std::string_view list);
+void                      gang(const std::vector<std::string>& ports);
+void                      open_port(ls::SerialPort& port);
+void                      resume(ls::SerialPort& port);
+void                      reset(ls::SerialPort& port);
+void                      hold();
+void                      serve();
+void                      batch();
+bool                      wait_for_swap(std::string_view message);
+int                       job_result(pid_t pid);
+bool                      needs_reset(int result);
+int                       run();
+int                       submit(int argc, const char* argv[]);
+std::string_view          result_name(int result);
+std::filesystem::path     cache_path(std::string_view lane);
+bool                      load_cache(std::string_view lane, std::vector<uint8_t>& buffer);
+void                      save_cache(std::string_view lane, const std::vector<uint8_t>& buffer);
+void                      drop_cache(std::string_view lane);
+
+int session(int argc, const char* argv[]) {
   sp::ArgParser parser {
       std::make_tuple(
           sp::HelpSection("\nAvailable options:"),
@@ -74,11 +246,22 @@ int main(int argc, const char* argv[]) {
           sp::SwitchOption {"high", args.high, sp::args("-h", "--high"), "Use high mode"},
           sp::SwitchOption {"low", args.low, sp::args("-l", "--low"), "Use low mode"},
           sp::SwitchOption {"overwrite", args.overwrite, sp::args("-o", "--overwrite"), "Overwrite output file"},
+          sp::SwitchOption {"smart", args.smart, sp::args("-m", "--smart"), "Only write bytes that changed"},
+          sp::SwitchOption {"full", args.full, sp::args("-f", "--full"), "Send the whole file, ignoring the cache"},
+          sp::SwitchOption {"compress", args.compress, sp::args("-x", "--compress"), "Compress runs of repeated words"},
           sp::SwitchOption {"verbose", args.verbose, sp::args("-v", "--verbose"), "Use verbose mode"},
           sp::SwitchOption {"debug", args.debug, sp::args("-d", "--debug"), "use debug mode"},
-          sp::Option {"port", args.port, sp::args("-p", "--port"), "Port to use", true},
+          sp::Option {"port", args.port, sp::args("-p", "--port"), "Ports to use, separated by commas or as a glob", true},
           sp::Option {"rfile", args.receive_file, sp::args("-r", "--receive"), "File to receive into"},
-          sp::Option {"sfile", args.send_file, sp::args("-s", "--send"), "File to send"}),
+          sp::Option {"sfile", args.send_file, sp::args("-s", "--send"), "File to send"},
+          sp::Option {"vfile", args.verify_file, sp::args("-y", "--verify"), "File to compare the chips against"},
+          sp::Option {"baud", args.baud, sp::args("-b", "--baud="), "Fastest baud rate to negotiate"},
+          sp::Option {"chip", args.chip, sp::args("-c", "--chip"), "Timing profile: generic, 28C16, 28C64 or 28C256"},
+          sp::Option {"size", args.size, sp::args("-z", "--size="), "Words per chip, defaults to the size of the chip"},
+          sp::Option {"tag", args.tag, sp::args("-t", "--tag"), "Name of the chips, to cache them by instead of the port"},
+          sp::Option {"daemon", args.daemon, sp::args("-k", "--daemon"), "Keep the port open, taking jobs from this socket"},
+          sp::Option {"manifest", args.manifest, sp::args("-j", "--manifest"), "Run every job listed in this file"},
+          sp::Option {"wait", args.wait, sp::args("-w", "--wait="), "Seconds to wait for a chip swap, 0 waits for enter"}),
       "Very Simple Architecture EEPROM Programmer\n"};
 
   try {
@@ -112,6 +295,44 @@ int main(int argc, const char* argv[]) {
     args.receive_file.erase(args.receive_file.begin());
   }
 
+  if (args.verify_file.starts_with('=')) {
+    args.verify_file.erase(args.verify_file.begin());
+  }
+
+  if (args.chip.starts_with('=')) {
+    args.chip.erase(args.chip.begin());
+  }
+
+  if (args.tag.starts_with('=')) {
+    args.tag.erase(args.tag.begin());
+  }
+
+  if (args.daemon.starts_with('=')) {
+    args.daemon.erase(args.daemon.begin());
+  }
+
+  if (args.manifest.starts_with('=')) {
+    args.manifest.erase(args.manifest.begin());
+  }
+
+  // Jobs name the socket of the daemon as their port
+  if (held_port) args.port = held_name;
+
+  // The daemon holding the port runs the whole session, on files it opens itself
+  if (std::filesystem::is_socket(args.port)) {
+    if (args.send_file == "-" || args.verify_file == "-") {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] A daemon can't read images from standard input\n");
+      exit(6);
+    }
+
+    exit(submit(argc, argv));
+  }
+
+  return run();
+}
+
+// Everything after the arguments, which is also what every job of a manifest runs
+int run() {
   fmt::print("[INF] Using version {:#x}\n", version);
 
   if (args.high && args.low) {
@@ -120,65 +341,210 @@ int main(int argc, const char* argv[]) {
     exit(5);
   }
 
-  if (!args.send_file.empty() && !args.receive_file.empty()) {
-    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Cannot send and receive in the same session\n");
+  uint8_t max_baud_rate = 0;
+
+  while (max_baud_rate + 1 < baud_rate_count && baud_rates[max_baud_rate + 1].first <= args.baud) {
+    max_baud_rate++;
+  }
+
+  if (baud_rates[max_baud_rate].first != args.baud) {
+    fmt::print(fmt::fg(fmt::terminal_color::red),
+               "[ERR] Unsupported baud rate {}, use one of 9600, 115200, 500000 or 1000000\n",
+               args.baud);
+    exit(5);
+  }
+
+  while (args.chip_profile < chip_profile_count && chip_profiles[args.chip_profile].first != args.chip) {
+    args.chip_profile++;
+  }
+
+  if (args.chip_profile == chip_profile_count) {
+    fmt::print(fmt::fg(fmt::terminal_color::red),
+               "[ERR] Unknown chip {}, use one of generic, 28C16, 28C64 or 28C256\n",
+               args.chip);
+    exit(5);
+  }
+
+  if (args.size == 0) args.size = chip_profiles[args.chip_profile].second;
+
+  // The controller reads and writes whole blocks of 256 words and its counter wraps at the last address
+  if (args.size < 256 || args.size > 32768 || (args.size & (args.size - 1)) != 0) {
+    fmt::print(fmt::fg(fmt::terminal_color::red),
+               "[ERR] Unsupported size {}, use a power of two between 256 and 32768\n",
+               args.size);
+    exit(5);
+  }
+
+  std::vector<std::string> ports = expand_ports(args.port);
+
+  if (ports.empty()) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] No port matches {}\n", args.port);
+    exit(4);
+  }
+
+  if (ports.size() > 1 && !args.receive_file.empty()) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Cannot receive from more than one port\n");
+    exit(6);
+  }
+
+  if (ports.size() > 1 && !args.tag.empty()) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] A tag names a single set of chips, it needs a single port\n");
+    exit(5);
+  }
+
+  args.port = ports[0];
+
+  if (!args.daemon.empty() || !args.manifest.empty()) {
+    if (!args.daemon.empty() && !args.manifest.empty()) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] A daemon takes its jobs from the socket, not a manifest\n");
+      exit(6);
+    }
+
+    if (ports.size() > 1) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] A daemon or a manifest needs a single port\n");
+      exit(5);
+    }
+
+    if (!args.send_file.empty() || !args.receive_file.empty() || !args.verify_file.empty()) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] A daemon or a manifest brings its own files\n");
+      exit(6);
+    }
+
+    if (!args.daemon.empty()) serve();
+    batch();
+  }
+
+  state.send_buffer_high.assign(args.size, 0x00);
+  state.send_buffer_low.assign(args.size, 0x00);
+  state.recv_buffer_high.assign(args.size, 0x00);
+  state.recv_buffer_low.assign(args.size, 0x00);
+  state.cache_buffer_high.assign(args.size, 0x00);
+  state.cache_buffer_low.assign(args.size, 0x00);
+
+  if (!args.receive_file.empty() && !args.verify_file.empty()) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Cannot receive and verify in the same session\n");
+    exit(6);
+  }
+
+  // Writes can be followed by a read back or a verify, which are both compared against what was written
+  if (!args.send_file.empty() && !args.verify_file.empty() && args.send_file != args.verify_file) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Can only verify the file that is sent in the same session\n");
     exit(6);
   }
 
+  // Images to write and images to verify against are loaded the same way
+  const std::string& image = args.send_file.empty() ? args.verify_file : args.send_file;
+
   std::ofstream recvf;
   std::ifstream sendf;
 
   try {
-    if (!args.send_file.empty()) {
-      if (!std::filesystem::exists(args.send_file)) {
-        fmt::print("[INF] File {} doesn't exist\n", args.send_file);
+    if (!image.empty()) {
+      // A file named - is standard input
+      if (image != "-" && !std::filesystem::exists(image)) {
+        fmt::print("[INF] File {} doesn't exist\n", image);
         exit(7);
       }
 
-      sendf.open(args.send_file, std::ofstream::binary);
-      fmt::print("[INF] Opened {}\n", args.send_file);
+      if (record_start(image)) {
+        sendf.open(image, std::ofstream::binary);
+        fmt::print("[INF] Opened {}\n", image);
 
-      if (args.high || args.low) {
-        if (std::filesystem::file_size(args.send_file) != 256) {
-          fmt::print(fmt::fg(fmt::terminal_color::red),
-                     "[ERR] Using single byte mode, but {} isn't exactly 256 bytes long\n",
-                     args.send_file);
-          exit(9);
+        load_records(sendf, image);
+
+      } else {
+        load_raw(image);
+      }
+    }
+
+    // Every port gets a process of its own from here on, which returns here with args.port set, the cache is per port
+    if (ports.size() > 1) gang(ports);
+
+    if (!args.send_file.empty()) {
+      bool cached = (args.low || load_cache("high", state.cache_buffer_high)) &&
+                    (args.high || load_cache("low", state.cache_buffer_low));
+
+      // Bytes a sparse image doesn't set keep what the chips hold, as far as the cache knows
+      if (cached && !state.populated_high.empty()) {
+        for (uint32_t i = 0; i < args.size; i++) {
+          if (!state.populated_high[i]) state.send_buffer_high[i] = state.cache_buffer_high[i];
+          if (!state.populated_low[i]) state.send_buffer_low[i] = state.cache_buffer_low[i];
         }
+      }
 
-        state.total_bytes = 256;
+      state.partial = !cached && !state.populated_high.empty();
 
-      } else {
-        if (std::filesystem::file_size(args.send_file) != 512) {
-          fmt::print(fmt::fg(fmt::terminal_color::red),
-                     "[ERR] Using single byte mode, but {} isn't exactly 512 bytes long\n",
-                     args.send_file);
-          exit(9);
+      if (cached && !args.full) {
+        uint32_t changed = 0;
+        uint32_t start   = 0;
+        uint32_t run     = 0;
+
+        // Only the runs of words that changed since the last write
+        for (uint32_t i = 0; i < args.size; i++) {
+          bool differs = (!args.low && state.send_buffer_high[i] != state.cache_buffer_high[i]) ||
+                         (!args.high && state.send_buffer_low[i] != state.cache_buffer_low[i]);
+
+          if (differs) {
+            if (run++ == 0) start = i;
+            changed++;
+
+          } else if (run != 0) {
+            add_chunks(start, run);
+            run = 0;
+          }
         }
 
-        state.total_bytes = 512;
-      }
+        if (run != 0) add_chunks(start, run);
+
+        if (changed == 0 && args.receive_file.empty() && args.verify_file.empty()) {
+          fmt::print("[INF] {} matches what was last written to the chips, nothing to do\n", args.send_file);
+          exit(0);
+        }
 
-      fmt::print("[INF] Reading {}...\n", args.send_file);
-      uint8_t i = 0;
+        state.total_bytes = (args.high || args.low) ? changed : changed * 2;
 
-      do {
-        if (!args.low) {
-          sendf.read((char*)(state.send_buffer_high + i), 1);
+        if (changed == 0) {
+          fmt::print("[INF] {} matches what was last written to the chips, only checking them\n", args.send_file);
+        } else {
+          fmt::print("[INF] Only sending the {} words that changed since the last write\n", changed);
         }
 
-        if (!args.high) {
-          sendf.read((char*)(state.send_buffer_low) + i, 1);
+      } else if (!state.populated_high.empty()) {
+        uint32_t words  = 0;
+        uint32_t filled = 0;
+        uint32_t start  = 0;
+        uint32_t run    = 0;
+
+        // Only the runs of words the image sets
+        for (uint32_t i = 0; i < args.size; i++) {
+          if (populated(i)) {
+            if (run++ == 0) start = i;
+            words++;
+
+            // The other chip of a word only half set gets the fill byte, unless the cache knows better
+            if (!args.high && !args.low && !cached && state.populated_high[i] != state.populated_low[i]) filled++;
+
+          } else if (run != 0) {
+            add_chunks(start, run);
+            run = 0;
+          }
         }
 
-        if (args.debug) {
+        if (run != 0) add_chunks(start, run);
+
+        state.total_bytes = (args.high || args.low) ? words : words * 2;
+
+        fmt::print("[INF] Only sending the {} words that {} sets\n", words, args.send_file);
+
+        if (filled) {
           fmt::print(fmt::fg(fmt::terminal_color::yellow),
-                     "[DBG] Send buffer {:#x} : {:#x} {:#x}\n",
-                     i,
-                     state.send_buffer_high[i],
-                     state.send_buffer_low[i]);
+                     "[WRN] {} words only set one chip, the other one gets 0xFF there\n",
+                     filled);
         }
-      } while (i++ < 0xFF);
+
+      } else {
+        add_chunks(0x00, args.size);
+      }
     }
 
     if (!args.receive_file.empty()) {
@@ -201,45 +567,64 @@ int main(int argc, const char* argv[]) {
     exit(8);
   }
 
-  ls::SerialPort port {};
+  ls::SerialPort  own_port {};
+  ls::SerialPort& port = held_port ? *held_port : own_port;
 
-  try {
-    port.Open(args.port);
+  if (!held_port) {
+    open_port(port);
+    fmt::print("[INF] Port opened\n[INF] Waiting for controller\n");
 
-  } catch (std::runtime_error& err) {
-    std::cout << err.what() << std::endl;
-    exit(4);
+  } else {
+    resume(port);
+    fmt::print("[INF] Restarting controller\n");
   }
 
-  port.SetBaudRate(ls::BaudRate::BAUD_9600);
-  port.SetCharacterSize(ls::CharacterSize::CHAR_SIZE_8);
-  port.SetFlowControl(ls::FlowControl::FLOW_CONTROL_NONE);
-  port.SetParity(ls::Parity::PARITY_NONE);
+  ls::DataBuffer rx_buffer;
+  size_t         rx_pos = 0;
+  int            result = 0;
 
-  fmt::print("[INF] Port opened\n[INF] Waiting for controller\n");
+  state.deadline = std::chrono::steady_clock::now() + phase_timeout();
 
   do {
     if (state.sending) {
-      fmt::print("[INF] Sending data to controller\n");
-      send_word(port, 0x06, 0xFF);
+      // Fill every free slot, the controller programs one chunk while the next ones arrive and never gets more than it
+      // has room for
+      while (state.chunks_sent < state.chunks_done + state.slots && state.chunks_sent < state.chunks.size()) {
+        send_chunk(port, state.chunks_sent++);
+      }
+
+      state.sending  = false;
+      state.deadline = std::chrono::steady_clock::now() + phase_timeout();
+    }
 
-      uint8_t i = 0;
+    if (state.testing && std::chrono::steady_clock::now() > state.test_deadline) {
+      state.testing = false;
 
-      do {
-        send_word(port, state.send_buffer_high[i], state.send_buffer_low[i]);
-      } while (i++ < 0xFF);
+      // The controller gives up on the test pattern sooner than we do, so it is already back on the old rate
+      fmt::print(fmt::fg(fmt::terminal_color::yellow),
+                 "[WRN] No answer at {} baud, falling back\n",
+                 baud_rates[state.baud_proposed].first);
+      switch_baud_rate(port, state.baud_rate);
 
-      fmt::print("[INF] Waiting for controller to write data\n");
-      state.sending = false;
-      state.waiting = true;
+      if (state.baud_proposed - 1 > state.baud_rate) {
+        propose_baud_rate(port, state.baud_proposed - 1);
+      } else {
+        send_flags(port);
+      }
     }
 
-    if (port.GetNumberOfBytesAvailable() > 1) {
-      uint8_t data_high = 0x00;
-      uint8_t data_low  = 0x00;
+    if (rx_buffer.size() - rx_pos < 2 && !receive(port, rx_buffer, rx_pos)) {
+      fmt::print(fmt::fg(fmt::terminal_color::red),
+                 "{}[ERR] Controller stopped responding while {}, aborting...\n",
+                 state.waiting ? "\n" : "",
+                 phase_name());
+      result = 10;
+      break;
+    }
 
-      port.ReadByte(data_high);
-      port.ReadByte(data_low);
+    if (rx_buffer.size() - rx_pos > 1) {
+      uint8_t data_high = rx_buffer[rx_pos++];
+      uint8_t data_low  = rx_buffer[rx_pos++];
 
       if (args.verbose) {
         fmt::print(fmt::fg(fmt::terminal_color::bright_green),
@@ -249,18 +634,171 @@ int main(int argc, const char* argv[]) {
                    data_low);
       }
 
-      if (state.receiving) {
-        state.recv_buffer_high[state.recv_buffer_pos] = data_high;
-        state.recv_buffer_low[state.recv_buffer_pos]  = data_low;
+      if (state.failed) {
+        if (state.failed_pos == 0) {
+          state.failed_start = (data_high << 8) | data_low;
 
-        if (state.recv_size == 0) {
-          state.recv_buffer_pos = 0;
-          state.receiving       = false;
+        } else {
+          // Bit n of the bitmap stands for word n of the chunk, starting from the least significant bit of each byte
+          std::vector<uint16_t>& addresses = state.failed == 0x09 ? state.failed_high : state.failed_low;
+          uint16_t               offset    = (state.failed_pos - 1) * 16;
+          uint16_t               bits      = data_high | (data_low << 8);
+
+          for (uint8_t bit = 0; bit < 16; bit++) {
+            if (!(bits & (1 << bit))) continue;
+
+            addresses.push_back(state.failed_start + offset + bit);
+            state.error_bytes++;
+          }
+        }
+
+        if (state.failed_pos++ == state.failed_size) state.failed = 0x00;
+
+      } else if (state.checksums) {
+        uint32_t& checksum = state.block_checksums[state.checksums_pos / 2];
+        checksum           = (checksum << 16) | (data_high << 8) | data_low;
+
+        if (++state.checksums_pos == state.checksums_size) {
+          state.checksums = false;
+
+          for (uint16_t block = 0; block < state.block_checksums.size() && block * 256u < args.size; block++) {
+            if (state.block_checksums[block] == block_checksum(block)) continue;
+
+            // Sparse images don't care about blocks they don't set
+            bool needed = false;
+            for (uint32_t i = block * 256u; i < block * 256u + 256 && !needed; i++) needed = populated(i);
+
+            if (!needed) continue;
+
+            state.diff_blocks.push_back(block);
+            state.mismatched.push_back(block);
+          }
+
+          if (state.diff_blocks.empty()) {
+            fmt::print("[INF] Chips match {}, {} blocks checked\n", image, state.block_checksums.size());
+            state.waiting = false;
+
+          } else {
+            fmt::print(fmt::fg(fmt::terminal_color::yellow),
+                       "[WRN] {} of {} blocks don't match {}, reading them back\n",
+                       state.diff_blocks.size(),
+                       state.block_checksums.size(),
+                       image);
+
+            request_block(port, state.diff_blocks.front());
+            state.diff_blocks.pop_front();
+          }
+        }
+
+      } else if (state.summary) {
+        if (state.summary_pos < 4) {
+          uint32_t& count = state.summary_words[state.summary_pos / 2];
+          count           = (count << 16) | (data_high << 8) | data_low;
+        }
+
+        if (state.summary_pos++ == state.summary_size) {
+          state.summary = false;
+          state.waiting = false;
+
+          fmt::print("\r[INF] Controller wrote {} bytes of data with {} errors",
+                     state.total_bytes,
+                     state.summary_words[0]);
+
+          if (args.smart) fmt::print(", {} bytes were already up to date", state.summary_words[1]);
+          if (state.retries) fmt::print(", {} chunks had to be sent again", state.retries);
+          fmt::print("\n");
+
+          if (!state.failed_high.empty()) {
+            fmt::print(fmt::fg(fmt::terminal_color::red),
+                       "[ERR] Controller couldn't write {} of high EEPROM\n",
+                       address_ranges(state.failed_high));
+          }
+
+          if (!state.failed_low.empty()) {
+            fmt::print(fmt::fg(fmt::terminal_color::red),
+                       "[ERR] Controller couldn't write {} of low EEPROM\n",
+                       address_ranges(state.failed_low));
+          }
+
+          if (args.compress) {
+            // Every byte costs a start and a stop bit on top of its own 8
+            uint32_t saved = (state.raw_bytes - state.chunk_bytes) * 10000 / baud_rates[state.baud_rate].first;
+
+            fmt::print("[INF] Compressed {} bytes of chunks into {} ({:.1f}%), saving {}ms on the wire\n",
+                       state.raw_bytes,
+                       state.chunk_bytes,
+                       100.0 * state.chunk_bytes / state.raw_bytes,
+                       saved);
+          }
+
+          // Remember what the chips hold now, or forget it if some bytes may not have made it
+          // A sparse image says nothing about the rest of the chips without a cache to start from
+          if (state.summary_words[0] == 0 && !state.partial) {
+            if (!args.low) save_cache("high", state.send_buffer_high);
+            if (!args.high) save_cache("low", state.send_buffer_low);
+
+          } else {
+            if (!args.low) drop_cache("high");
+            if (!args.high) drop_cache("low");
+          }
+
+          // The controller reads the chips back as soon as the write is done, verifies have to be asked for
+          if (!args.receive_file.empty()) {
+            fmt::print("[INF] Waiting for controller to read back the chips\n");
+            state.waiting    = true;
+            state.block_next = true;
+
+          } else if (!args.verify_file.empty()) {
+            fmt::print("[INF] Waiting for controller to checksum the chips\n");
+            state.waiting = true;
+            send_word(port, 0x16, 0x00);
+          }
+        }
+
+      } else if (state.receiving && state.recv_checking) {
+        state.receiving     = false;
+        state.recv_checking = false;
+
+        if (((data_high << 8) | data_low) != state.recv_crc) {
+          fmt::print(fmt::fg(fmt::terminal_color::yellow),
+                     "[WRN] Block {:#x} arrived corrupted, reading it again\n",
+                     state.recv_block);
+          state.bad_blocks.push_back(state.recv_block);
+        }
+
+        if (!state.rereading && (state.recv_block + 1u) * 256 < args.size) {
+          // Wait for the header of the next block
+          state.recv_block++;
+          state.waiting    = true;
+          state.block_next = true;
+
+        } else if (!state.bad_blocks.empty()) {
+          if (!retry(state.bad_blocks.front())) {
+            fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Too many corrupted blocks, aborting...\n");
+            result = 12;
+            break;
+          }
+
+          request_block(port, state.bad_blocks.front());
+          state.bad_blocks.pop_front();
+
+        } else if (!state.diff_blocks.empty()) {
+          request_block(port, state.diff_blocks.front());
+          state.diff_blocks.pop_front();
+
+        } else if (!args.verify_file.empty()) {
+          state.rereading = false;
+
+          // Only a checksum may have got corrupted on the way
+          if (!compare(state.mismatched, image)) result = 14;
+
+        } else {
+          state.receiving = false;
+          state.rereading = false;
 
           fmt::print("[INF] Done receiving data, writting to {}\n", args.receive_file);
-          uint8_t i = 0;
 
-          do {
+          for (uint32_t i = 0; i < args.size; i++) {
             if (!args.low) recvf.put((uint8_t)(state.recv_buffer_high[i]));
             if (!args.high) recvf.put((uint8_t)(state.recv_buffer_low[i]));
 
@@ -271,17 +809,51 @@ int main(int argc, const char* argv[]) {
                          state.recv_buffer_low[i],
                          args.receive_file);
             }
-          } while (i++ < 0xFF);
+          }
 
           recvf.flush();
 
+          // What was just written, read back in the same session
+          if (!args.send_file.empty()) {
+            std::vector<uint8_t> blocks;
+            for (uint32_t block = 0; block * 256 < args.size; block++) blocks.push_back(block);
+
+            if (!compare(blocks, image)) result = 14;
+          }
+        }
+
+      } else if (state.receiving) {
+        state.recv_buffer_high[state.recv_buffer_pos] = data_high;
+        state.recv_buffer_low[state.recv_buffer_pos]  = data_low;
+
+        state.recv_crc = crc16(state.recv_crc, data_high);
+        state.recv_crc = crc16(state.recv_crc, data_low);
+
+        // The CRC of the block follows its last word
+        if (state.recv_size == 0) {
+          state.recv_checking = true;
+
         } else {
           state.recv_size--;
           state.recv_buffer_pos++;
         }
 
       } else {
-        if (data_high == 0x01) {
+        if (data_high == 0x08 || state.block_next) {
+          // Blocks are always 256 words, the header is only checked where one could be
+          state.receiving  = true;
+          state.waiting    = false;
+          state.block_next = false;
+          state.recv_size  = 0xFF;
+
+          state.recv_buffer_pos = state.recv_block * 256;
+          state.recv_crc        = 0x0000;
+
+          if (state.recv_buffer_pos == 0 && !state.rereading) {
+            fmt::print("[INF] Receiving {:#x} words of data\n", args.size);
+          }
+
+        } else if (data_high == 0x01) {
           if (data_low != version) {
             fmt::print(fmt::fg(fmt::terminal_color::red),
                        "[ERR] We are using version {:#x} but controller is on version {:#x}\n",
@@ -294,15 +866,35 @@ int main(int argc, const char* argv[]) {
           state.setup     = false;
 
           fmt::print("[INF] Performing initial handshake\n");
+          propose_baud_rate(port, max_baud_rate);
+
+        } else if (data_high == 0x0c) {
+          if (data_low == state.baud_rate || data_low >= baud_rate_count) {
+            send_flags(port);
+
+          } else {
+            state.baud_proposed = data_low;
+            state.testing       = true;
+            state.test_deadline = std::chrono::steady_clock::now() + 500ms;
+
+            switch_baud_rate(port, data_low);
+            send_word(port, 0x0d, 0xa5);
+          }
+
+        } else if (data_high == 0x0d) {
+          if (state.testing && data_low == 0x5a) {
+            state.testing   = false;
+            state.baud_rate = state.baud_proposed;
 
-          send_word(port, 0x02, 0x01);
-          send_word(port, args.high, args.low);
-          send_word(port, args.receive_file.empty() ? 0x00 : 0x01, args.send_file.empty() ? 0x00 : 0x01);
+            fmt::print("[INF] Switched to {} baud\n", baud_rates[state.baud_rate].first);
+            send_flags(port);
+          }
 
         } else if (data_high == 0x03) {
           fmt::print(fmt::fg(fmt::terminal_color::red),
                      "[ERR] Received abort packed with parameter {:#x}, aborting...\n",
                      data_low);
+          result = 11;
           break;
 
         } else if (data_high == 0x04) {
@@ -312,91 +904,1250 @@ int main(int argc, const char* argv[]) {
         } else if (data_high == 0x05) {
           state.handshake = false;
 
-          if (!args.receive_file.empty()) {
+          // Reads and verifies after a write only start once it is done
+          if (!state.chunks.empty()) {
+            fmt::print("[INF] Sending data to controller\n");
+            state.waiting = true;
+
+          } else if (!args.receive_file.empty()) {
             fmt::print("[INF] Waiting for controller to read and send data\n");
             state.waiting = true;
 
-          } else if (!args.send_file.empty()) {
-            state.sending = true;
+          } else if (!args.verify_file.empty()) {
+            fmt::print("[INF] Waiting for controller to checksum the chips\n");
+            state.waiting = true;
+            send_word(port, 0x16, 0x00);
 
           } else {
             fmt::print("[INF] Nothing to do\n");
           }
 
-        } else if (data_high == 0x07) {
-          state.waiting = false;
-          fmt::print("\r[INF] Controller wrote {} bytes of data with {} errors\n", state.total_bytes, data_low);
-
-        } else if (data_high == 0x08) {
-          state.receiving = true;
-          state.waiting   = false;
-          state.recv_size = data_low;
+        } else if (data_high == 0x16) {
+          // Two words of CRC-32 for each block follow
+          state.checksums      = true;
+          state.checksums_size = (data_low + 1) * 2;
+          state.checksums_pos  = 0;
+          state.block_checksums.assign(data_low + 1, 0);
 
-          fmt::print("[INF] Receiving {:#x} words of data\n", data_low);
+        } else if (data_high == 0x07) {
+          state.summary          = true;
+          state.summary_size     = data_low;
+          state.summary_pos      = 0;
+          state.summary_words[0] = 0;
+          state.summary_words[1] = 0;
+
+        } else if (data_high == 0x09 || data_high == 0x0a) {
+          // The start address of a chunk and the bitmap of the words that didn't make it follow
+          state.failed      = data_high;
+          state.failed_size = data_low;
+          state.failed_pos  = 0;
+
+        } else if (data_high == 0x13) {
+          // The controller took data_low chunks so far, the next one and everything sent after it never made it. The
+          // count has no CRC, but it can't be below the chunks already done or above the ones sent.
+          size_t resend = state.chunks_sent - (uint8_t)(state.chunks_sent - data_low);
+          resend        = std::clamp(resend, state.chunks_done, state.chunks_sent);
+
+          if (!retry(resend)) {
+            fmt::print(fmt::fg(fmt::terminal_color::red), "\n[ERR] Too many corrupted chunks, aborting...\n");
+            result = 12;
+            break;
+          }
 
-        } else if (data_high == 0x09) {
-          state.error_bytes++;
-          fmt::print(fmt::fg(fmt::terminal_color::red),
-                     "{}[ERR] Controller couldn't write address {:#x} of high EEPROM\n",
+          fmt::print(fmt::fg(fmt::terminal_color::yellow),
+                     "{}[WRN] Chunk {} of {} arrived corrupted, sending it again\n",
                      args.verbose ? "" : "\r",
-                     data_low);
-
-          fmt::print("\r[INF] Controller wrote {}/{} words with {} errors",
-                     state.written_bytes + state.error_bytes,
-                     state.total_bytes,
-                     state.error_bytes);
-          std::cout.flush();
+                     resend + 1,
+                     state.chunks.size());
+
+          state.chunks_sent = resend;
+          state.sending     = true;
+
+        } else if (data_high == 0x11) {
+          // Credits for free chunk slots, all of them after the handshake and one for every chunk programmed. Chunks
+          // are always taken and programmed in order.
+          if (state.granted && state.chunks_done < state.chunks.size()) {
+            state.written_bytes += state.chunks[state.chunks_done++].second * (args.high || args.low ? 1 : 2);
+
+            fmt::print("\r[INF] Controller wrote {}/{} bytes with {} errors",
+                       state.written_bytes,
+                       state.total_bytes,
+                       state.error_bytes);
+            std::cout.flush();
+          }
 
-        } else if (data_high == 0x0a) {
-          state.error_bytes++;
-          fmt::print(fmt::fg(fmt::terminal_color::red),
-                     "{}[ERR] Controller couldn't write address {:#x} of low EEPROM\n",
-                     args.verbose ? "" : "\r",
-                     data_low);
+          // The first one tells how many slots there are, which can't be more than the controller has
+          if (!state.granted) state.slots = std::min(data_low, chunk_slots);
 
-          fmt::print("\r[INF] Controller wrote {}/{} words with {} errors",
-                     state.written_bytes + state.error_bytes,
-                     state.total_bytes,
-                     state.error_bytes);
-          std::cout.flush();
+          // A resend may have started over from a chunk the controller had taken after all
+          state.chunks_sent = std::max(state.chunks_sent, state.chunks_done);
+          state.granted     = true;
+          state.sending     = !args.send_file.empty() && state.chunks_sent < state.chunks.size();
 
-        } else if (data_high == 0x0b) {
-          fmt::print("\r[INF] Controller wrote {}/{} words with {} errors",
-                     ++state.written_bytes + state.error_bytes,
-                     state.total_bytes,
-                     state.error_bytes);
-          std::cout.flush();
+          // Nothing but blocks follows the handshake of a read without a write
+          state.block_next = !args.receive_file.empty() && state.chunks.empty();
 
         } else {
           fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Received unknown data packet, aborting...\n");
+          result = 13;
           break;
         }
       }
+
+      // Every packet may have moved us to a different phase, with a different allowance for silence
+      state.deadline = std::chrono::steady_clock::now() + phase_timeout();
     }
   } while (state.receiving || state.ready || state.setup || state.handshake || state.sending || state.debug ||
-           state.waiting);
+           state.waiting || state.testing);
 
   fmt::print("[INF] Connection ended\n");
 
-  fmt::print("[INF] Closing port\n");
-  port.Close();
+  if (!held_port) {
+    fmt::print("[INF] Closing port\n");
+    port.Close();
+  }
 
   if (sendf.is_open()) {
     sendf.close();
-    fmt::print("[INF] Closed {}\n", args.receive_file);
+    fmt::print("[INF] Closed {}\n", image);
   }
 
   if (recvf.is_open()) {
     recvf.close();
-    fmt::print("[INF] Closed {}\n", args.send_file);
+    fmt::print("[INF] Closed {}\n", args.receive_file);
   }
 
-  return 0;
+  return result;
 }
 
+int main(int argc, const char* argv[]) { return session(argc, argv); }
+
 void send_word(ls::SerialPort& port, uint8_t data_high, uint8_t data_low) {
-  port.WriteByte((uint8_t)data_high);
-  port.WriteByte((uint8_t)data_low);
+  port.Write(ls::DataBuffer {data_high, data_low});
 
   if (args.verbose) fmt::print(fmt::fg(fmt::terminal_color::blue), "[OUT] {:#x} {:#x}\n", data_high, data_low);
 }
+
+void send_frame(ls::SerialPort& port, const ls::DataBuffer& frame) {
+  port.Write(frame);
+
+  if (args.verbose) fmt::print(fmt::fg(fmt::terminal_color::blue), "{}", hexdump(frame));
+}
+
+void send_chunk(ls::SerialPort& port, size_t index) {
+  auto [start, length] = state.chunks[index];
+
+  // Only worth it if the tokens come out shorter than the words themselves
+  ls::DataBuffer tokens = args.compress ? compress_chunk(start, length) : ls::DataBuffer {};
+  bool           packed = args.compress && tokens.size() < 2u * length;
+
+  // Header with the last chunk flag in the top bit, chunk number, start address, then the words, all in a single write
+  ls::DataBuffer frame;
+  frame.reserve(8 + 2 * length);
+
+  frame.push_back(packed ? 0x12 : 0x10);
+  frame.push_back((length - 1) | (index + 1 == state.chunks.size() ? 0x80 : 0x00));
+  frame.push_back(index & 0xFF);
+  frame.push_back(0x00);
+  frame.push_back(start >> 8);
+  frame.push_back(start & 0xFF);
+
+  if (packed) {
+    frame.insert(frame.end(), tokens.begin(), tokens.end());
+
+  } else {
+    for (uint16_t address = start; address < start + length; address++) {
+      frame.push_back(state.send_buffer_high[address]);
+      frame.push_back(state.send_buffer_low[address]);
+    }
+  }
+
+  // Every chunk ends with the CRC of everything before it
+  uint16_t crc = 0x0000;
+
+  for (uint8_t data : frame) {
+    crc = crc16(crc, data);
+  }
+
+  frame.push_back(crc >> 8);
+  frame.push_back(crc & 0xFF);
+
+  state.chunk_bytes += frame.size();
+  state.raw_bytes += 8 + 2 * length;
+
+  send_frame(port, frame);
+}
+
+std::string address_ranges(const std::vector<uint16_t>& addresses) {
+  std::string ranges;
+
+  // Addresses arrive in order, so consecutive ones collapse into a range
+  for (size_t i = 0; i < addresses.size();) {
+    size_t end = i;
+
+    while (end + 1 < addresses.size() && addresses[end + 1] == addresses[end] + 1) {
+      end++;
+    }
+
+    if (!ranges.empty()) ranges += ", ";
+    ranges += end == i ? fmt::format("{:#x}", addresses[i]) : fmt::format("{:#x}-{:#x}", addresses[i], addresses[end]);
+
+    i = end + 1;
+  }
+
+  return ranges;
+}
+
+void load_raw(const std::string& image) {
+  // The whole image at once, mapped straight from the file or read from standard input
+  std::vector<uint8_t> input;
+  const uint8_t*       data = nullptr;
+  size_t               size = 0;
+  void*                map  = MAP_FAILED;
+
+  if (image == "-") {
+    fmt::print("[INF] Reading image from standard input...\n");
+
+    char    buffer[65536];
+    ssize_t length;
+
+    while ((length = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) input.insert(input.end(), buffer, buffer + length);
+
+    data = input.data();
+    size = input.size();
+
+  } else {
+    int         fd = open(image.c_str(), O_RDONLY);
+    struct stat info {};
+
+    if (fd < 0 || fstat(fd, &info) != 0) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't open {}\n", image);
+      exit(8);
+    }
+
+    size = info.st_size;
+    if (size) map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (size && map == MAP_FAILED) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't map {}\n", image);
+      exit(8);
+    }
+
+    data = (const uint8_t*)map;
+    fmt::print("[INF] Mapped {}\n", image);
+  }
+
+  uint32_t lanes = args.high || args.low ? 1 : 2;
+
+  if (size != args.size * lanes) {
+    fmt::print(fmt::fg(fmt::terminal_color::red),
+               "[ERR] Using {} byte mode, but {} isn't exactly {} bytes long\n",
+               lanes == 1 ? "single" : "dual",
+               image,
+               args.size * lanes);
+    exit(9);
+  }
+
+  state.total_bytes = size;
+
+  // Single byte images are a lane already, dual ones are split in a single pass the compiler can vectorize
+  if (args.high) {
+    std::copy(data, data + size, state.send_buffer_high.begin());
+
+  } else if (args.low) {
+    std::copy(data, data + size, state.send_buffer_low.begin());
+
+  } else {
+    uint8_t* __restrict__ high = state.send_buffer_high.data();
+    uint8_t* __restrict__ low  = state.send_buffer_low.data();
+
+    for (uint32_t i = 0; i < args.size; i++) {
+      high[i] = data[i * 2];
+      low[i]  = data[i * 2 + 1];
+    }
+  }
+
+  if (map != MAP_FAILED) munmap(map, size);
+
+  if (args.debug) {
+    for (uint32_t i = 0; i < args.size; i++) {
+      fmt::print(fmt::fg(fmt::terminal_color::yellow),
+                 "[DBG] Send buffer {:#x} : {:#x} {:#x}\n",
+                 i,
+                 state.send_buffer_high[i],
+                 state.send_buffer_low[i]);
+    }
+  }
+}
+
+char record_start(const std::string& path) {
+  std::string extension = std::filesystem::path(path).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+  if (extension == ".hex" || extension == ".ihx" || extension == ".ihex") return ':';
+  if (extension == ".srec" || extension == ".s19" || extension == ".s28" || extension == ".s37" || extension == ".mot") {
+    return 'S';
+  }
+
+  return '\0';
+}
+
+void load_records(std::ifstream& sendf, const std::string& image) {
+  // Addresses are bytes of the same layout as raw images: one per word in single byte mode, high and low
+  // interleaved otherwise. Bytes the records don't set are 0xFF, like an erased chip.
+  char        start = record_start(image);
+  uint32_t    base  = 0;
+  std::string line;
+
+  state.send_buffer_high.assign(args.size, 0xFF);
+  state.send_buffer_low.assign(args.size, 0xFF);
+  state.populated_high.assign(args.size, false);
+  state.populated_low.assign(args.size, false);
+
+  fmt::print("[INF] Reading records from {}...\n", image);
+
+  for (int number = 1; std::getline(sendf, line); number++) {
+    while (!line.empty() && std::isspace((uint8_t)line.back())) line.pop_back();
+    if (line.empty()) continue;
+
+    // Every record is a start character, an S-record type digit, then pairs of hex digits that add up to a fixed
+    // checksum: 0x00 for Intel HEX and 0xFF for S-records
+    size_t               first = start == 'S' ? 2 : 1;
+    std::vector<uint8_t> bytes;
+    uint8_t              sum = 0;
+
+    for (size_t i = first; i + 1 < line.size() && std::isxdigit((uint8_t)line[i]) && std::isxdigit((uint8_t)line[i + 1]);
+         i += 2) {
+      bytes.push_back(std::stoi(line.substr(i, 2), nullptr, 16));
+      sum += bytes.back();
+    }
+
+    bool valid = line[0] == start && line.size() == first + bytes.size() * 2 && !bytes.empty();
+
+    if (start == ':') {
+      valid = valid && bytes.size() >= 5u && bytes[0] + 5u == bytes.size() && sum == 0x00;
+    } else {
+      valid = valid && line.size() > 1 && std::isdigit((uint8_t)line[1]) && bytes[0] + 1u == bytes.size() && sum == 0xFF;
+    }
+
+    if (!valid) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] {}:{}: malformed record\n", image, number);
+      exit(9);
+    }
+
+    uint32_t address = 0;
+    size_t   data    = 0;
+
+    if (start == ':') {
+      uint8_t type = bytes[3];
+
+      // Only data and the upper bits of the addresses matter, start addresses are for CPUs that boot from a file
+      if (type == 0x01) break;
+
+      if (type == 0x02 || type == 0x04) {
+        base = ((bytes[4] << 8) | bytes[5]) << (type == 0x02 ? 4 : 16);
+        continue;
+      }
+
+      if (type != 0x00) continue;
+
+      address = base + ((bytes[1] << 8) | bytes[2]);
+      data    = 4;
+
+    } else {
+      // S1, S2 and S3 hold data with 16, 24 and 32 bit addresses
+      uint8_t type = line[1] - '0';
+
+      if (type < 1 || type > 3 || bytes.size() < type + 3u) continue;
+
+      for (uint8_t i = 0; i <= type; i++) address = (address << 8) | bytes[1 + i];
+      data = type + 2;
+    }
+
+    for (size_t i = data; i + 1 < bytes.size(); i++, address++) {
+      uint32_t word = args.high || args.low ? address : address / 2;
+      bool     high = args.high || (!args.low && address % 2 == 0);
+
+      if (word >= args.size) {
+        fmt::print(fmt::fg(fmt::terminal_color::red),
+                   "[ERR] {}:{}: address {:#x} is past the end of the chips\n",
+                   image,
+                   number,
+                   address);
+        exit(9);
+      }
+
+      (high ? state.send_buffer_high : state.send_buffer_low)[word] = bytes[i];
+      (high ? state.populated_high : state.populated_low)[word]     = true;
+    }
+  }
+}
+
+bool populated(uint32_t word) {
+  if (state.populated_high.empty()) return true;
+
+  return (!args.low && state.populated_high[word]) || (!args.high && state.populated_low[word]);
+}
+
+bool compare(const std::vector<uint8_t>& blocks, std::string_view image) {
+  std::vector<uint16_t> differs_high;
+  std::vector<uint16_t> differs_low;
+
+  for (uint8_t block : blocks) {
+    for (uint32_t i = block * 256u; i < block * 256u + 256; i++) {
+      // Only what a sparse image sets
+      bool high = !args.low && (state.populated_high.empty() || state.populated_high[i]);
+      bool low  = !args.high && (state.populated_low.empty() || state.populated_low[i]);
+
+      if (high && state.recv_buffer_high[i] != state.send_buffer_high[i]) differs_high.push_back(i);
+      if (low && state.recv_buffer_low[i] != state.send_buffer_low[i]) differs_low.push_back(i);
+    }
+  }
+
+  if (!differs_high.empty()) {
+    fmt::print(fmt::fg(fmt::terminal_color::red),
+               "[ERR] High EEPROM differs from {} at {}\n",
+               image,
+               address_ranges(differs_high));
+  }
+
+  if (!differs_low.empty()) {
+    fmt::print(fmt::fg(fmt::terminal_color::red),
+               "[ERR] Low EEPROM differs from {} at {}\n",
+               image,
+               address_ranges(differs_low));
+  }
+
+  if (!differs_high.empty() || !differs_low.empty()) return false;
+
+  fmt::print("[INF] Chips match {}\n", image);
+  return true;
+}
+
+bool retry(size_t index) {
+  // Only the same chunk or block failing over and over means the line is unusable
+  state.retry_attempt = state.retries++ != 0 && state.retry_index == index ? state.retry_attempt + 1 : 1;
+  state.retry_index   = index;
+
+  return state.retry_attempt <= max_retries;
+}
+
+uint16_t crc16(uint16_t crc, uint8_t data) {
+  // CRC-16/XMODEM, same as _crc_xmodem_update() on the controller
+  crc ^= data << 8;
+
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+
+  return crc;
+}
+
+uint32_t crc32(uint32_t crc, uint8_t data) {
+  // CRC-32 as used by zlib, same as crc32_update() on the controller
+  crc ^= data;
+
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = crc & 0x01 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+  }
+
+  return crc;
+}
+
+uint32_t block_checksum(uint8_t block) {
+  // The controller reads the chip that isn't used as zero
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (uint32_t i = block * 256u; i < block * 256u + 256; i++) {
+    crc = crc32(crc, args.low ? 0x00 : state.send_buffer_high[i]);
+    crc = crc32(crc, args.high ? 0x00 : state.send_buffer_low[i]);
+  }
+
+  return ~crc;
+}
+
+void request_block(ls::SerialPort& port, uint8_t block) {
+  state.rereading  = true;
+  state.recv_block = block;
+  state.waiting    = true;
+  state.block_next = true;
+
+  send_word(port, 0x14, block);
+}
+
+ls::DataBuffer compress_chunk(uint16_t start, uint8_t length) {
+  ls::DataBuffer tokens;
+  uint32_t       end     = start + length;
+  uint32_t       literal = start;
+
+  auto flush_literal = [&](uint32_t until) {
+    if (until == literal) return;
+
+    tokens.push_back(0x00);
+    tokens.push_back(until - literal - 1);
+
+    for (uint32_t address = literal; address < until; address++) {
+      tokens.push_back(state.send_buffer_high[address]);
+      tokens.push_back(state.send_buffer_low[address]);
+    }
+  };
+
+  // Runs of at least 3 equal words become 0x01 {words - 1} {high} {low}, everything in between goes out as
+  // 0x00 {words - 1} followed by the words
+  for (uint32_t address = start; address < end;) {
+    uint32_t run = address + 1;
+
+    while (run < end && state.send_buffer_high[run] == state.send_buffer_high[address] &&
+           state.send_buffer_low[run] == state.send_buffer_low[address]) {
+      run++;
+    }
+
+    if (run - address >= 3) {
+      flush_literal(address);
+
+      tokens.push_back(0x01);
+      tokens.push_back(run - address - 1);
+      tokens.push_back(state.send_buffer_high[address]);
+      tokens.push_back(state.send_buffer_low[address]);
+
+      literal = run;
+    }
+
+    address = run;
+  }
+
+  flush_literal(end);
+
+  return tokens;
+}
+
+void add_chunks(uint16_t start, uint32_t length) {
+  // Runs have to be added in address order, the controller's counter only counts up and anything behind it costs a
+  // wrap around the whole chip
+  uint32_t address = start;
+  uint32_t end     = start + length;
+
+  // Split the run wherever it crosses a chunk boundary
+  while (address < end) {
+    uint32_t boundary = (address / chunk_words + 1) * chunk_words;
+    uint32_t words    = std::min<uint32_t>(boundary, end) - address;
+
+    state.chunks.emplace_back(address, words);
+    address += words;
+  }
+}
+
+std::string hexdump(const ls::DataBuffer& data) {
+  std::string dump;
+  dump.reserve((data.size() / 16 + 1) * 64);
+
+  for (size_t row = 0; row < data.size(); row += 16) {
+    dump += fmt::format("[OUT] {:04x}:", row);
+
+    for (size_t i = row; i < std::min(row + 16, data.size()); i++) {
+      dump += fmt::format(" {:02x}", data[i]);
+    }
+
+    dump += '\n';
+  }
+
+  return dump;
+}
+
+void send_flags(ls::SerialPort& port) {
+  send_word(port, 0x02, 0x03);
+  send_word(port, args.high, args.low);
+  send_word(port, args.receive_file.empty() ? 0x00 : 0x01, state.chunks.empty() ? 0x00 : 0x01);
+  send_word(port, args.chip_profile, args.smart);
+  send_word(port, (args.size - 1) >> 8, (args.size - 1) & 0xFF);
+}
+
+void propose_baud_rate(ls::SerialPort& port, uint8_t rate) {
+  state.baud_proposed = rate;
+  send_word(port, 0x0c, rate);
+}
+
+void switch_baud_rate(ls::SerialPort& port, uint8_t rate) {
+  // Anything still queued has to leave at the old rate
+  port.DrainWriteBuffer();
+  port.SetBaudRate(baud_rates[rate].second);
+
+  if (args.debug) {
+    fmt::print(fmt::fg(fmt::terminal_color::yellow), "[DBG] Port set to {} baud\n", baud_rates[rate].first);
+  }
+}
+
+bool receive(ls::SerialPort& port, ls::DataBuffer& buffer, size_t& position) {
+  auto deadline = state.testing ? std::min(state.deadline, state.test_deadline) : state.deadline;
+  auto now      = std::chrono::steady_clock::now();
+
+  if (now >= state.deadline) return false;
+
+  // Sleep until the controller sends something instead of spinning on the number of available bytes
+  pollfd fds {port.GetFileDescriptor(), POLLIN, 0};
+  int    timeout = std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count();
+
+  if (poll(&fds, 1, timeout) <= 0 || !(fds.revents & POLLIN)) return true;
+
+  int available = port.GetNumberOfBytesAvailable();
+  if (available <= 0) return true;
+
+  if (position == buffer.size()) {
+    buffer.clear();
+    position = 0;
+  }
+
+  ls::DataBuffer chunk;
+  port.Read(chunk, available);
+  buffer.insert(buffer.end(), chunk.begin(), chunk.end());
+
+  return true;
+}
+
+std::chrono::milliseconds phase_timeout() {
+  // Longest silence from the controller that is still considered normal in each phase
+  if (state.setup) return 5000ms;
+  if (state.handshake || state.testing) return 2000ms;
+  if (state.receiving) return 2000ms;
+  if (state.waiting && (!args.receive_file.empty() || !args.verify_file.empty())) return 20000ms;
+  // The first credit back only comes after a whole chunk has been programmed
+  if (state.waiting) return 10000ms;
+
+  return 2000ms;
+}
+
+std::string_view phase_name() {
+  if (state.setup) return "waiting for the version packet";
+  if (state.handshake || state.testing) return "performing the handshake";
+  if (state.receiving) return "receiving data";
+  if (state.waiting && (!args.receive_file.empty() || !args.verify_file.empty())) return "reading data";
+  if (state.waiting) return "writing data";
+
+  return "idle";
+}
+
+std::filesystem::path cache_path(std::string_view lane) {
+  const char* cache_home = std::getenv("XDG_CACHE_HOME");
+  const char* home       = std::getenv("HOME");
+
+  std::filesystem::path directory = cache_home && *cache_home ? std::filesystem::path(cache_home)
+                                                              : std::filesystem::path(home ? home : ".") / ".cache";
+
+  // Without a tag the chips are told apart by the port they are flashed through
+  std::string key = args.tag.empty() ? args.port : args.tag;
+  std::replace(key.begin(), key.end(), '/', '_');
+  key.erase(0, key.find_first_not_of('_'));
+
+  return directory / "eeprom-uploader" / fmt::format("{}.{}", key, lane);
+}
+
+bool load_cache(std::string_view lane, std::vector<uint8_t>& buffer) {
+  std::error_code       error;
+  std::filesystem::path path = cache_path(lane);
+
+  // A cache of a different size was written for other chips
+  if (std::filesystem::file_size(path, error) != buffer.size() || error) return false;
+
+  std::ifstream cachef(path, std::ifstream::binary);
+  cachef.read((char*)buffer.data(), buffer.size());
+
+  if (args.debug) fmt::print(fmt::fg(fmt::terminal_color::yellow), "[DBG] Loaded cache {}\n", path.string());
+
+  return cachef.good();
+}
+
+void save_cache(std::string_view lane, const std::vector<uint8_t>& buffer) {
+  std::error_code       error;
+  std::filesystem::path path = cache_path(lane);
+
+  std::filesystem::create_directories(path.parent_path(), error);
+
+  std::ofstream cachef(path, std::ofstream::binary | std::ofstream::trunc);
+  cachef.write((const char*)buffer.data(), buffer.size());
+
+  if (!cachef.good()) {
+    fmt::print(fmt::fg(fmt::terminal_color::yellow), "[WRN] Couldn't update cache {}\n", path.string());
+  } else if (args.debug) {
+    fmt::print(fmt::fg(fmt::terminal_color::yellow), "[DBG] Updated cache {}\n", path.string());
+  }
+}
+
+void drop_cache(std::string_view lane) {
+  std::error_code error;
+  std::filesystem::remove(cache_path(lane), error);
+}
+
+std::vector<std::string> expand_ports(std::string_view list) {
+  std::vector<std::string> ports;
+
+  while (!list.empty()) {
+    size_t      comma = list.find(',');
+    std::string entry {list.substr(0, comma)};
+
+    list = comma == std::string_view::npos ? std::string_view {} : list.substr(comma + 1);
+
+    if (entry.find_first_of("*?[") == std::string::npos) {
+      if (!entry.empty()) ports.push_back(entry);
+      continue;
+    }
+
+    glob_t matches {};
+
+    if (glob(entry.c_str(), 0, nullptr, &matches) == 0) {
+      ports.insert(ports.end(), matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+    }
+
+    globfree(&matches);
+  }
+
+  return ports;
+}
+
+void gang(const std::vector<std::string>& ports) {
+  // Output of every board, kept apart so that it doesn't interleave, and how far its write has got
+  typedef struct board_t {
+    int                                   fd      = -1;
+    pid_t                                 pid     = 0;
+    int                                   result  = 0;
+    uint32_t                              written = 0;
+    uint32_t                              total   = 0;
+    std::string                           output  = "";
+    std::chrono::steady_clock::time_point end {};
+  } board_t;
+
+  std::vector<board_t> boards(ports.size());
+  auto                 start = std::chrono::steady_clock::now();
+
+  fmt::print("[INF] Programming {} boards\n", ports.size());
+  std::cout.flush();
+
+  for (size_t i = 0; i < ports.size(); i++) {
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't create a pipe for {}\n", ports[i]);
+      exit(8);
+    }
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't start a process for {}\n", ports[i]);
+      exit(8);
+    }
+
+    if (pid == 0) {
+      for (size_t j = 0; j < i; j++) close(boards[j].fd);
+
+      dup2(fds[1], STDOUT_FILENO);
+      dup2(fds[1], STDERR_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+
+      // Progress lines end in a flush, everything else in a new line
+      setvbuf(stdout, nullptr, _IOLBF, 0);
+
+      args.port = ports[i];
+      return;
+    }
+
+    close(fds[1]);
+    boards[i].fd  = fds[0];
+    boards[i].pid = pid;
+  }
+
+  size_t running = boards.size();
+
+  while (running > 0) {
+    std::vector<pollfd> fds;
+
+    for (board_t& board : boards) {
+      if (board.fd >= 0) fds.push_back({board.fd, POLLIN, 0});
+    }
+
+    if (poll(fds.data(), fds.size(), -1) <= 0) continue;
+
+    for (const pollfd& fd : fds) {
+      if (!fd.revents) continue;
+
+      board_t& board = *std::find_if(boards.begin(), boards.end(), [&](const board_t& b) { return b.fd == fd.fd; });
+      char     buffer[4096];
+      ssize_t  size = read(board.fd, buffer, sizeof(buffer));
+
+      if (size <= 0) {
+        close(board.fd);
+        board.fd  = -1;
+        board.end = std::chrono::steady_clock::now();
+        running--;
+        continue;
+      }
+
+      board.output.append(buffer, size);
+
+      // Only the last progress line of each board matters, the summary line doesn't parse as one
+      size_t progress = board.output.rfind("Controller wrote ");
+
+      if (progress != std::string::npos) {
+        sscanf(board.output.c_str() + progress, "Controller wrote %u/%u", &board.written, &board.total);
+      }
+    }
+
+    uint32_t written = 0;
+    uint32_t total   = 0;
+
+    for (const board_t& board : boards) {
+      written += board.written;
+      total += board.total;
+    }
+
+    fmt::print("\r[INF] {}/{} boards done", boards.size() - running, boards.size());
+    if (total) fmt::print(", controllers wrote {}/{} bytes", written, total);
+    std::cout.flush();
+  }
+
+  fmt::print("\n");
+
+  bool failed = false;
+
+  for (board_t& board : boards) {
+    board.result = job_result(board.pid);
+    failed |= board.result != 0;
+  }
+
+  fmt::print("[INF] {:<24} {:<32} {}\n", "Port", "Result", "Time");
+
+  for (size_t i = 0; i < boards.size(); i++) {
+    std::chrono::duration<double> time = boards[i].end - start;
+
+    fmt::print(boards[i].result ? fmt::fg(fmt::terminal_color::red) : fmt::text_style {},
+               "[{}] {:<24} {:<32} {:.1f}s\n",
+               boards[i].result ? "ERR" : "INF",
+               ports[i],
+               result_name(boards[i].result),
+               time.count());
+  }
+
+  // The whole session of the boards that failed, or of all of them in verbose mode
+  for (size_t i = 0; i < boards.size(); i++) {
+    if (!boards[i].result && !args.verbose) continue;
+
+    fmt::print("\n[INF] Output of {}:\n{}", ports[i], boards[i].output);
+  }
+
+  exit(failed ? 15 : 0);
+}
+
+void open_port(ls::SerialPort& port) {
+  try {
+    port.Open(args.port);
+
+  } catch (std::runtime_error& err) {
+    std::cout << err.what() << std::endl;
+    exit(4);
+  }
+
+  port.SetBaudRate(baud_rates[0].second);
+  port.SetCharacterSize(ls::CharacterSize::CHAR_SIZE_8);
+  port.SetFlowControl(ls::FlowControl::FLOW_CONTROL_NONE);
+  port.SetParity(ls::Parity::PARITY_NONE);
+}
+
+void resume(ls::SerialPort& port) {
+  // The controller is idle on the rate the last job negotiated, which is still what the port is set to. Asking for
+  // the same rate again doesn't cost a test pattern.
+  while (state.baud_rate + 1 < baud_rate_count && baud_rates[state.baud_rate].second != port.GetBaudRate()) {
+    state.baud_rate++;
+  }
+
+  // Leftovers of the last job would be taken for the start of this one
+  port.FlushInputBuffer();
+  send_word(port, 0x15, 0x00);
+}
+
+void reset(ls::SerialPort& port) {
+  // Opening the port resets the controller, which sends its version once it is out of the bootloader
+  if (port.IsOpen()) {
+    port.Close();
+    std::this_thread::sleep_for(100ms);
+  }
+
+  open_port(port);
+  port.FlushInputBuffer();
+
+  auto    deadline = std::chrono::steady_clock::now() + 5000ms;
+  uint8_t last     = 0x00;
+
+  while (std::chrono::steady_clock::now() < deadline) {
+    pollfd fds {port.GetFileDescriptor(), POLLIN, 0};
+    if (poll(&fds, 1, 100) <= 0) continue;
+
+    int available = port.GetNumberOfBytesAvailable();
+    if (available <= 0) continue;
+
+    ls::DataBuffer data;
+    port.Read(data, available);
+
+    for (uint8_t byte : data) {
+      if (last == 0x01 && byte == version) return;
+      last = byte;
+    }
+  }
+
+  fmt::print(fmt::fg(fmt::terminal_color::yellow), "[WRN] Controller on {} didn't come out of reset\n", args.port);
+}
+
+void hold() {
+  held_port = new ls::SerialPort {};
+  held_name = args.port;
+
+  reset(*held_port);
+}
+
+int job_result(pid_t pid) {
+  int status = 0;
+  waitpid(pid, &status, 0);
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+bool needs_reset(int result) {
+  // Anything that went wrong on the line may have left the controller halted or halfway through a session, only a
+  // reset gets it back for sure
+  return (result >= 10 && result <= 13) || result > 128;
+}
+
+void serve() {
+  int         listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un address {};
+
+  address.sun_family = AF_UNIX;
+  args.daemon.copy(address.sun_path, sizeof(address.sun_path) - 1);
+  unlink(args.daemon.c_str());
+
+  if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 8) != 0) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't listen on {}\n", args.daemon);
+    exit(4);
+  }
+
+  // Clients that connect in the meantime wait for the controller to come up
+  hold();
+
+  fmt::print("[INF] Holding {} open, waiting for jobs on {}\n", held_name, args.daemon);
+  std::cout.flush();
+
+  while (true) {
+    int client = accept(listener, nullptr, nullptr);
+    if (client < 0) continue;
+
+    // The working directory of the client, then its arguments, each ending in a NUL and the job in an empty one
+    std::string job;
+    char        buffer[4096];
+    ssize_t     size;
+
+    while (!job.ends_with(std::string_view {"\0\0", 2}) && (size = read(client, buffer, sizeof(buffer))) > 0) {
+      job.append(buffer, size);
+    }
+
+    std::vector<std::string> fields;
+
+    for (size_t start = 0, end; (end = job.find('\0', start)) != std::string::npos && end > start; start = end + 1) {
+      fields.push_back(job.substr(start, end - start));
+    }
+
+    if (fields.empty()) {
+      close(client);
+      continue;
+    }
+
+    auto  start = std::chrono::steady_clock::now();
+    pid_t pid   = fork();
+
+    // Likely a passing shortage, only this job fails
+    if (pid < 0) {
+      std::string error  = fmt::format("[ERR] Couldn't start a process for the job\n");
+      char        end[2] = {'\0', 8};
+
+      fmt::print(fmt::fg(fmt::terminal_color::red), "{}", error);
+      std::cout.flush();
+
+      send(client, error.data(), error.size(), MSG_NOSIGNAL);
+      send(client, end, sizeof(end), MSG_NOSIGNAL);
+      close(client);
+      continue;
+    }
+
+    if (pid == 0) {
+      std::vector<const char*> argv {"uploader"};
+      for (size_t i = 1; i < fields.size(); i++) argv.push_back(fields[i].c_str());
+
+      close(listener);
+      dup2(client, STDOUT_FILENO);
+      dup2(client, STDERR_FILENO);
+      close(client);
+      setvbuf(stdout, nullptr, _IOLBF, 0);
+
+      if (chdir(fields[0].c_str()) != 0) {
+        fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't change to {}\n", fields[0]);
+        exit(8);
+      }
+
+      args = args_t {};
+      exit(session(argv.size(), argv.data()));
+    }
+
+    int                           result = job_result(pid);
+    std::chrono::duration<double> time   = std::chrono::steady_clock::now() - start;
+    char                          end[2] = {'\0', (char)result};
+
+    // The client may be gone already
+    send(client, end, sizeof(end), MSG_NOSIGNAL);
+    close(client);
+
+    std::string command;
+    for (size_t i = 1; i < fields.size(); i++) command += (i > 1 ? " " : "") + fields[i];
+
+    fmt::print("[INF] Job {} {} after {:.2f}s\n", command, result_name(result), time.count());
+
+    if (needs_reset(result)) {
+      fmt::print(fmt::fg(fmt::terminal_color::yellow), "[WRN] Resetting controller\n");
+      reset(*held_port);
+    }
+
+    std::cout.flush();
+  }
+}
+
+void batch() {
+  // One job per line as action, mode and file, with swap lines in between for the chips that get changed
+  typedef struct job_t {
+    std::string action = "";
+    std::string mode   = "";
+    std::string file   = "";
+    std::string swap   = "";
+    int         result = 0;
+    double      time   = 0;
+  } job_t;
+
+  std::ifstream      manifestf(args.manifest);
+  std::vector<job_t> jobs;
+  std::string        swap;
+  std::string        line;
+
+  if (!manifestf.is_open()) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't open manifest {}\n", args.manifest);
+    exit(7);
+  }
+
+  for (int number = 1; std::getline(manifestf, line); number++) {
+    std::istringstream words(line.substr(0, line.find('#')));
+    job_t              job;
+
+    if (!(words >> job.action)) continue;
+
+    if (job.action == "swap") {
+      std::getline(words >> std::ws, swap);
+      if (swap.empty()) swap = "Swap the chips";
+      continue;
+    }
+
+    words >> job.mode >> job.file;
+
+    if (job.action != "write" && job.action != "verify" && job.action != "read" && job.action != "write+verify") {
+      fmt::print(fmt::fg(fmt::terminal_color::red),
+                 "[ERR] {}:{}: unknown action {}, use write, verify, read or write+verify\n",
+                 args.manifest,
+                 number,
+                 job.action);
+      exit(5);
+    }
+
+    if (job.mode != "high" && job.mode != "low" && job.mode != "dual") {
+      fmt::print(fmt::fg(fmt::terminal_color::red),
+                 "[ERR] {}:{}: unknown mode {}, use high, low or dual\n",
+                 args.manifest,
+                 number,
+                 job.mode);
+      exit(5);
+    }
+
+    if (job.file.empty()) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] {}:{}: missing file\n", args.manifest, number);
+      exit(5);
+    }
+
+    // Files are relative to the manifest
+    job.file = (std::filesystem::path(args.manifest).parent_path() / job.file).string();
+
+    if (job.action != "read" && !std::filesystem::exists(job.file)) {
+      fmt::print("[INF] File {} doesn't exist\n", job.file);
+      exit(7);
+    }
+
+    job.swap = swap;
+    swap.clear();
+    jobs.push_back(job);
+  }
+
+  hold();
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    job_t& job = jobs[i];
+
+    if (!job.swap.empty()) {
+      if (!wait_for_swap(job.swap)) break;
+
+      // The cache describes the chips that were just pulled, the next write has to send everything
+      drop_cache("high");
+      drop_cache("low");
+    }
+
+    fmt::print("[INF] Job {}/{}: {} {} {}\n", i + 1, jobs.size(), job.action, job.mode, job.file);
+    std::cout.flush();
+
+    auto  start = std::chrono::steady_clock::now();
+    pid_t pid   = fork();
+
+    if (pid < 0) {
+      fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't start a process for job {}\n", i + 1);
+      exit(8);
+    }
+
+    if (pid == 0) {
+      args.manifest.clear();
+      args.high = job.mode == "high";
+      args.low  = job.mode == "low";
+
+      if (job.action.starts_with("write")) args.send_file = job.file;
+      if (job.action.ends_with("verify")) args.verify_file = job.file;
+      if (job.action == "read") args.receive_file = job.file;
+
+      exit(run());
+    }
+
+    job.result = job_result(pid);
+
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    job.time                           = time.count();
+
+    if (needs_reset(job.result)) {
+      fmt::print(fmt::fg(fmt::terminal_color::yellow), "[WRN] Resetting controller\n");
+      reset(*held_port);
+    }
+  }
+
+  bool failed = false;
+
+  fmt::print("[INF] {:<40} {:<32} {}\n", "Job", "Result", "Time");
+
+  for (const job_t& job : jobs) {
+    std::string name = fmt::format("{} {} {}", job.action, job.mode, job.file);
+
+    failed |= job.result != 0;
+    fmt::print(job.result ? fmt::fg(fmt::terminal_color::red) : fmt::text_style {},
+               "[{}] {:<40} {:<32} {:.1f}s\n",
+               job.result ? "ERR" : "INF",
+               name,
+               job.time ? result_name(job.result) : "skipped",
+               job.time);
+  }
+
+  exit(failed ? 15 : 0);
+}
+
+bool wait_for_swap(std::string_view message) {
+  if (args.wait) {
+    fmt::print("[INF] {}, going on in {}s or on enter\n", message, args.wait);
+  } else {
+    fmt::print("[INF] {}, then press enter\n", message);
+  }
+
+  std::cout.flush();
+
+  pollfd fds {STDIN_FILENO, POLLIN, 0};
+  int    ready = poll(&fds, 1, args.wait ? args.wait * 1000 : -1);
+
+  if (ready <= 0) return true;
+
+  std::string line;
+  if (std::getline(std::cin, line)) return true;
+
+  // Without any input left, only the timeout can tell when the chips are in
+  if (args.wait) {
+    std::this_thread::sleep_for(std::chrono::seconds(args.wait));
+    return true;
+  }
+
+  fmt::print(fmt::fg(fmt::terminal_color::yellow), "[WRN] No input left, skipping the remaining jobs\n");
+  return false;
+}
+
+int submit(int argc, const char* argv[]) {
+  int         fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un address {};
+
+  address.sun_family = AF_UNIX;
+  args.port.copy(address.sun_path, sizeof(address.sun_path) - 1);
+
+  if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't reach the daemon on {}\n", args.port);
+    return 4;
+  }
+
+  std::string job = std::filesystem::current_path().string() + '\0';
+
+  for (int i = 1; i < argc; i++) {
+    job += argv[i];
+    job += '\0';
+  }
+
+  job += '\0';
+
+  if (send(fd, job.data(), job.size(), MSG_NOSIGNAL) != (ssize_t)job.size()) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] Couldn't send the job to the daemon on {}\n", args.port);
+    return 4;
+  }
+
+  // Output of the session, then a NUL and its result
+  char    buffer[4096];
+  ssize_t size;
+  bool    ended  = false;
+  int     result = -1;
+
+  while (result < 0 && (size = read(fd, buffer, sizeof(buffer))) > 0) {
+    char* end = ended ? buffer : std::find(buffer, buffer + size, '\0');
+
+    if (!ended) {
+      std::cout.write(buffer, end - buffer).flush();
+      if (end == buffer + size) continue;
+
+      ended = true;
+      end++;
+    }
+
+    if (end < buffer + size) result = (uint8_t)*end;
+  }
+
+  close(fd);
+
+  if (result < 0) {
+    fmt::print(fmt::fg(fmt::terminal_color::red), "[ERR] The daemon on {} hung up\n", args.port);
+    return 10;
+  }
+
+  return result;
+}
+
+std::string_view result_name(int result) {
+  switch (result) {
+    case 0: return "done";
+    case 2: return "controller on another version";
+    case 4: return "couldn't open port";
+    case 10: return "controller stopped responding";
+    case 11: return "aborted by controller";
+    case 12: return "too many corrupted packets";
+    case 13: return "unknown packet";
+    case 14: return "chips don't match";
+    default: return result > 128 ? "killed" : "failed";
+  }
+}